@@ -0,0 +1,1050 @@
+/*****************************************************************************
+ * Copyright (C) 2012 Rémi Duraffort
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/**
+ * Accuracy test suite for every hook. The real time is measured with the
+ * system calls (bypassing the hooks and the vDSO) and compared to the time
+ * expected with the scale given in TIMESCALER_SCALE.
+ * Should be run with timescaler preloaded or linked with --wrap
+ * (TIMESCALER_WRAP).
+ */
+
+#include <errno.h>          /* errno, EINTR, ETIMEDOUT */
+#include <linux/futex.h>    /* FUTEX_WAIT */
+#include <math.h>           /* fabs */
+#include <poll.h>           /* poll */
+#include <pthread.h>        /* pthread_create, pthread_join, pthread_kill */
+#include <signal.h>         /* kill, sigaction, sigprocmask, sigtimedwait */
+#include <spawn.h>          /* posix_spawn */
+#include <stdio.h>          /* fprintf, printf */
+#include <stdlib.h>         /* atof, getenv, mkstemp, realpath */
+#include <string.h>         /* memset, strcmp, strrchr */
+#include <sys/epoll.h>      /* epoll_create1, epoll_pwait, epoll_wait */
+#include <sys/select.h>     /* pselect, select */
+#include <sys/syscall.h>    /* SYS_clock_gettime, SYS_nanosleep */
+#include <sys/time.h>       /* getitimer, gettimeofday, setitimer */
+#include <sys/times.h>      /* times */
+#include <sys/wait.h>       /* waitpid */
+#include <time.h>           /* clock_gettime, clock_nanosleep, nanosleep, time */
+#include <unistd.h>         /* alarm, execve, fork, sleep, syscall, ualarm */
+
+#ifndef TIMESCALER_WRAP
+# define __USE_GNU
+# include <dlfcn.h>         /* dlsym */
+#endif
+
+#include "timescaler.h"
+
+
+/** Virtual time used by most of the tests, in seconds */
+#define DURATION 0.1
+
+/** Number of threads reading the clock concurrently */
+#define THREADS 4
+
+/** Number of runs of a timed check before reporting a failure */
+#define RETRIES 5
+
+/** Number of short sleeps averaged in precision mode */
+#define PRECISION_LOOPS 100
+
+
+static double scale = 1.0;
+static unsigned failures = 0;
+static char *psz_self;
+
+
+/**
+ * Read the real monotonic clock
+ * @return the time in seconds
+ */
+static double real_now(void)
+{
+  struct timespec tp;
+  syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec + (double)tp.tv_nsec / 1000000000L;
+}
+
+
+/**
+ * Sleep for the given real time
+ * @param time: the time in seconds
+ */
+static void real_sleep(double time)
+{
+  struct timespec req = { .tv_sec = time,
+                          .tv_nsec = (time - (long)time) * 1000000000L };
+  syscall(SYS_nanosleep, &req, NULL);
+}
+
+
+/**
+ * Read the scaled monotonic clock
+ * @return the time in seconds
+ */
+static double scaled_now(void)
+{
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec + (double)tp.tv_nsec / 1000000000L;
+}
+
+
+/**
+ * Compare a measured time with the expected one: 5% of the expected time plus
+ * 200us for the scheduling latency
+ * @param measured: the measured time in seconds
+ * @param expected: the expected time in seconds
+ * @return 1 if the measured time is close enough, 0 otherwise
+ */
+static int within(double measured, double expected)
+{
+  return fabs(measured - expected) <= expected * 0.05 + 0.0002;
+}
+
+
+/**
+ * Report the comparison of a measured time with the expected one
+ * @param psz_name: the name of the check
+ * @param measured: the measured time in seconds
+ * @param expected: the expected time in seconds
+ */
+static void check(const char *psz_name, double measured, double expected)
+{
+  int ok = within(measured, expected);
+
+  printf("[%s] %-24s scale=%-5.2f measured=%.6f expected=%.6f\n",
+         ok ? "PASS" : "FAIL", psz_name, scale, measured, expected);
+  if(!ok)
+    failures++;
+}
+
+
+/**
+ * Check a measurement that can be repeated, so that a single preemption of
+ * the test does not fail the check
+ * @param psz_name: the name of the check
+ * @param measured: the expression measuring the time in seconds
+ * @param expected: the expected time in seconds
+ */
+#define CHECK(psz_name, measured, expected)                                  \
+  do                                                                          \
+  {                                                                           \
+    double measured_;                                                         \
+    unsigned try_ = 0;                                                        \
+    do                                                                        \
+      measured_ = (measured);                                                 \
+    while(!within(measured_, (expected)) && ++try_ < RETRIES);                \
+    check(psz_name, measured_, (expected));                                   \
+  } while(0)
+
+
+/**
+ * Measure the real time taken by a statement
+ * @param stmt: the statement
+ * @return the real time in seconds
+ */
+#define ELAPSED(stmt)                                                         \
+  ({                                                                          \
+    double start_ = real_now();                                               \
+    stmt;                                                                     \
+    real_now() - start_;                                                      \
+  })
+
+
+/**
+ * Check the remaining time of a call interrupted after DURATION: it is
+ * computed between the interruption and the return of the call
+ * @param psz_name: the name of the check
+ * @param remain: the remaining time in seconds
+ * @param slept: the scaled time spent in the call in seconds
+ */
+static void check_remain(const char *psz_name, double remain, double slept)
+{
+  double min = 10 * DURATION - slept, max = 9 * DURATION;
+  int ok = (remain >= min || within(remain, min)) &&
+           (remain <= max || within(remain, max));
+
+  printf("[%s] %-24s scale=%-5.2f measured=%.6f expected=%.6f-%.6f\n",
+         ok ? "PASS" : "FAIL", psz_name, scale, remain, min, max);
+  if(!ok)
+    failures++;
+}
+
+
+/**
+ * Report a check that does not measure any time
+ * @param psz_name: the name of the check
+ * @param ok: the result
+ */
+static void check_true(const char *psz_name, int ok)
+{
+  printf("[%s] %-24s scale=%-5.2f\n", ok ? "PASS" : "FAIL", psz_name, scale);
+  if(!ok)
+    failures++;
+}
+
+
+/**
+ * Interrupt the main thread with SIGUSR1 after the given real time
+ */
+static pthread_t main_thread;
+
+static void *interrupter(void *data)
+{
+  real_sleep(*(double *)data);
+  pthread_kill(main_thread, SIGUSR1);
+  return NULL;
+}
+
+static void on_signal(int signum)
+{
+  (void)signum;
+}
+
+static pthread_t interrupt_after(double *time)
+{
+  pthread_t thread;
+  pthread_create(&thread, NULL, interrupter, time);
+  return thread;
+}
+
+
+/**
+ * Wait for SIGALRM, that should be blocked, for at most ten seconds
+ */
+static void wait_alarm(void)
+{
+  sigset_t set;
+  struct timespec timeout = { .tv_sec = 10, .tv_nsec = 0 };
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigtimedwait(&set, NULL, &timeout);
+}
+
+
+/**
+ * Discard a pending SIGALRM
+ */
+static void flush_alarm(void)
+{
+  sigset_t set;
+  struct timespec timeout = { .tv_sec = 0, .tv_nsec = 0 };
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigtimedwait(&set, NULL, &timeout);
+}
+
+
+static void test_alarm(void)
+{
+  /* The scaled time can be shorter than one second */
+  alarm(1);
+  check_true("alarm remain", alarm(0) == 1);
+
+  CHECK("alarm", ELAPSED(alarm(1); wait_alarm()), scale);
+}
+
+
+/**
+ * Measure the scaled time elapsed on a clock during a real sleep. The real
+ * sleep is longer than requested so the scaled time is brought back to the
+ * requested real time.
+ * @param clk_id: the clock
+ * @param time: the real time to sleep in seconds
+ * @return the scaled time in seconds
+ */
+static double scaled_elapsed(clockid_t clk_id, double time)
+{
+  struct timespec start, end;
+
+  double real_start = real_now();
+  clock_gettime(clk_id, &start);
+  real_sleep(time);
+  clock_gettime(clk_id, &end);
+  double real_time = real_now() - real_start;
+
+  return (end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9) *
+         time / real_time;
+}
+
+
+static void test_clock_gettime(void)
+{
+  CHECK("clock_gettime realtime",
+        scaled_elapsed(CLOCK_REALTIME, DURATION * scale), DURATION);
+  CHECK("clock_gettime monotonic",
+        scaled_elapsed(CLOCK_MONOTONIC, DURATION * scale), DURATION);
+}
+
+
+static void test_clock_nanosleep(void)
+{
+  struct timespec req = { .tv_sec = 0, .tv_nsec = DURATION * 1000000000L };
+  CHECK("clock_nanosleep",
+        ELAPSED(clock_nanosleep(CLOCK_MONOTONIC, 0, &req, NULL)),
+        DURATION * scale);
+
+  /* The absolute time is expressed in scaled time */
+  CHECK("clock_nanosleep abstime",
+        ELAPSED(clock_gettime(CLOCK_MONOTONIC, &req);
+                req.tv_nsec += DURATION * 1000000000L;
+                req.tv_sec += req.tv_nsec / 1000000000L;
+                req.tv_nsec %= 1000000000L;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, NULL)),
+        DURATION * scale);
+
+  /* Interrupted after 1/10 of the time */
+  struct timespec rem;
+  double after = DURATION * scale;
+  pthread_t thread = interrupt_after(&after);
+  req.tv_sec = 10 * DURATION;
+  req.tv_nsec = 0;
+  double start = real_now();
+  int return_value = clock_nanosleep(CLOCK_MONOTONIC, 0, &req, &rem);
+  double slept = (real_now() - start) / scale;
+  pthread_join(thread, NULL);
+  check_true("clock_nanosleep eintr", return_value == EINTR);
+  check_remain("clock_nanosleep remain", rem.tv_sec + rem.tv_nsec / 1e9, slept);
+}
+
+
+static void test_epoll(void)
+{
+  struct epoll_event event;
+  int epfd = epoll_create1(0);
+
+  CHECK("epoll_wait", ELAPSED(epoll_wait(epfd, &event, 1, DURATION * 1000)),
+        DURATION * scale);
+  CHECK("epoll_pwait",
+        ELAPSED(epoll_pwait(epfd, &event, 1, DURATION * 1000, NULL)),
+        DURATION * scale);
+
+  close(epfd);
+}
+
+
+static void test_futex(void)
+{
+  int (*func)(int *, int, int, const struct timespec *, int *, int);
+#ifdef TIMESCALER_WRAP
+  extern int futex(int *, int, int, const struct timespec *, int *, int);
+  func = futex;
+#else
+  /* The libc does not provide futex, only timescaler */
+  func = dlsym(RTLD_DEFAULT, "futex");
+  if(!func)
+  {
+    printf("[SKIP] %-24s scale=%-5.2f\n", "futex", scale);
+    return;
+  }
+#endif
+
+  int word = 0;
+  struct timespec timeout = { .tv_sec = 0,
+                              .tv_nsec = DURATION * 1000000000L };
+  CHECK("futex", ELAPSED(func(&word, FUTEX_WAIT, 0, &timeout, NULL, 0)),
+        DURATION * scale);
+}
+
+
+static void test_itimer(void)
+{
+  struct itimerval value, current;
+  memset(&value, 0, sizeof(value));
+
+  value.it_value.tv_sec = 1;
+  setitimer(ITIMER_REAL, &value, NULL);
+  getitimer(ITIMER_REAL, &current);
+  check("getitimer", current.it_value.tv_sec + current.it_value.tv_usec / 1e6,
+        1.0);
+
+  value.it_value.tv_sec = 0;
+  value.it_value.tv_usec = DURATION * 1000000L;
+  CHECK("setitimer", ELAPSED(setitimer(ITIMER_REAL, &value, NULL); wait_alarm()),
+        DURATION * scale);
+
+  /* A short timer is not truncated to 0, which would disarm it */
+  value.it_value.tv_usec = 1;
+  value.it_interval.tv_usec = 1;
+  CHECK("setitimer short",
+        ELAPSED(setitimer(ITIMER_REAL, &value, NULL); wait_alarm(); wait_alarm()),
+        0.0);
+  memset(&value, 0, sizeof(value));
+  setitimer(ITIMER_REAL, &value, NULL);
+  flush_alarm();
+}
+
+
+static double gettimeofday_elapsed(double time)
+{
+  struct timeval start, end;
+
+  double real_start = real_now();
+  gettimeofday(&start, NULL);
+  real_sleep(time);
+  gettimeofday(&end, NULL);
+  double real_time = real_now() - real_start;
+
+  return (end.tv_sec - start.tv_sec + (end.tv_usec - start.tv_usec) / 1e6) *
+         time / real_time;
+}
+
+
+static void test_gettimeofday(void)
+{
+  CHECK("gettimeofday", gettimeofday_elapsed(DURATION * scale), DURATION);
+}
+
+
+static void test_nanosleep(void)
+{
+  struct timespec req = { .tv_sec = 0, .tv_nsec = DURATION * 1000000000L };
+  CHECK("nanosleep", ELAPSED(nanosleep(&req, NULL)), DURATION * scale);
+
+  /* Interrupted after 1/10 of the time */
+  struct timespec rem;
+  double after = DURATION * scale;
+  pthread_t thread = interrupt_after(&after);
+  req.tv_sec = 10 * DURATION;
+  req.tv_nsec = 0;
+  double start = real_now();
+  int return_value = nanosleep(&req, &rem);
+  double slept = (real_now() - start) / scale;
+  pthread_join(thread, NULL);
+  check_true("nanosleep eintr", return_value == -1 && errno == EINTR);
+  check_remain("nanosleep remain", rem.tv_sec + rem.tv_nsec / 1e9, slept);
+}
+
+
+static void test_poll(void)
+{
+  CHECK("poll", ELAPSED(poll(NULL, 0, DURATION * 1000)), DURATION * scale);
+}
+
+
+static void test_select(void)
+{
+  struct timespec ts = { .tv_sec = 0, .tv_nsec = DURATION * 1000000000L };
+  CHECK("pselect", ELAPSED(pselect(0, NULL, NULL, NULL, &ts, NULL)),
+        DURATION * scale);
+
+  /* Linux updates the timeout of select */
+  struct timeval tv;
+  CHECK("select", ELAPSED(tv.tv_sec = 0;
+                          tv.tv_usec = DURATION * 1000000L;
+                          select(0, NULL, NULL, NULL, &tv)),
+        DURATION * scale);
+
+  /* Interrupted after 1/10 of the time: the timeout is updated by Linux */
+  double after = DURATION * scale;
+  pthread_t thread = interrupt_after(&after);
+  tv.tv_sec = 10 * DURATION;
+  tv.tv_usec = 0;
+  double start = real_now();
+  select(0, NULL, NULL, NULL, &tv);
+  double slept = (real_now() - start) / scale;
+  pthread_join(thread, NULL);
+  check_remain("select remain", tv.tv_sec + tv.tv_usec / 1e6, slept);
+}
+
+
+static void test_sleep(void)
+{
+  CHECK("sleep", ELAPSED(sleep(1)), scale);
+}
+
+
+/**
+ * Wait for the next scaled second
+ */
+static void next_second(void)
+{
+  time_t now = time(NULL);
+  while(time(NULL) == now)
+    real_sleep(0.0001);
+}
+
+
+static void test_time(void)
+{
+  /* Measure the real duration of a full scaled second */
+  CHECK("time", (next_second(), ELAPSED(next_second())), scale);
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  check_true("time gettimeofday", labs(time(NULL) - tv.tv_sec) <= 1);
+}
+
+
+static void test_times(void)
+{
+  struct tms buf;
+  long ticks = sysconf(_SC_CLK_TCK);
+
+  /* Expect the scaled equivalent of the real time actually slept */
+  double real_start = real_now();
+  clock_t start = times(&buf);
+  real_sleep(4 * DURATION * scale);
+  clock_t end = times(&buf);
+  double real_time = real_now() - real_start;
+  check("times", (double)(end - start) / ticks, real_time / scale);
+}
+
+
+static void test_ualarm(void)
+{
+  CHECK("ualarm", ELAPSED(ualarm(DURATION * 1000000L, 0); wait_alarm()),
+        DURATION * scale);
+  CHECK("ualarm short", ELAPSED(ualarm(1, 0); wait_alarm()), 0.0);
+}
+
+
+static void test_usleep(void)
+{
+  CHECK("usleep", ELAPSED(usleep(DURATION * 1000000L)), DURATION * scale);
+}
+
+
+/**
+ * In precision mode, check the mean accuracy of short sleeps: 10% of the
+ * expected time plus 20us
+ */
+static void test_precision(void)
+{
+  const char *psz_precision = getenv("TIMESCALER_PRECISION");
+  if(!psz_precision || !atoi(psz_precision))
+  {
+    printf("[SKIP] %-24s scale=%-5.2f\n", "precision", scale);
+    return;
+  }
+
+  struct timespec req = { .tv_sec = 0, .tv_nsec = 1000000L };
+  unsigned i;
+  double start = real_now();
+  for(i = 0; i < PRECISION_LOOPS; i++)
+    nanosleep(&req, NULL);
+  double mean = (real_now() - start) / PRECISION_LOOPS;
+
+  double expected = 0.001 * scale;
+  int ok = fabs(mean - expected) <= expected * 0.1 + 0.00002;
+  printf("[%s] %-24s scale=%-5.2f measured=%.6f expected=%.6f\n",
+         ok ? "PASS" : "FAIL", "precision", scale, mean, expected);
+  if(!ok)
+    failures++;
+}
+
+
+/**
+ * Read the monotonic clock in a loop and count the backward steps
+ */
+static volatile int running;
+
+static void *reader(void *data)
+{
+  unsigned *backward = data;
+  struct timespec previous, current;
+
+  clock_gettime(CLOCK_MONOTONIC, &previous);
+  while(running)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &current);
+    if(current.tv_sec < previous.tv_sec ||
+       (current.tv_sec == previous.tv_sec && current.tv_nsec < previous.tv_nsec))
+      (*backward)++;
+    previous = current;
+  }
+  return NULL;
+}
+
+
+static void test_monotonic(void)
+{
+  pthread_t threads[THREADS];
+  unsigned backward[THREADS];
+  unsigned i, total = 0;
+
+  running = 1;
+  for(i = 0; i < THREADS; i++)
+  {
+    backward[i] = 0;
+    pthread_create(&threads[i], NULL, reader, &backward[i]);
+  }
+
+  /* Re-anchor the clocks while they are read */
+  double end = real_now() + 3 * DURATION;
+  while(real_now() < end)
+  {
+    if(timescaler_is_loaded())
+    {
+      timescaler_set_scale(scale * 2);
+      timescaler_pause();
+      timescaler_advance(1000);
+      timescaler_resume();
+      timescaler_set_scale(scale);
+    }
+    real_sleep(0.0001);
+  }
+
+  running = 0;
+  for(i = 0; i < THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+    total += backward[i];
+  }
+  check_true("monotonic threads", total == 0);
+}
+
+
+static void *nanosleeper(void *data)
+{
+  nanosleep((const struct timespec *)data, NULL);
+  running = 0;
+  return NULL;
+}
+
+static void *abssleeper(void *data)
+{
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                  (const struct timespec *)data, NULL);
+  running = 0;
+  return NULL;
+}
+
+
+/**
+ * Measure the real time a thread sleeping for a long time takes to wake up
+ * when the clocks are advanced past its deadline
+ * @return the real time in seconds
+ */
+static double advance_wakeup(void)
+{
+  pthread_t thread;
+  struct timespec req = { .tv_sec = 100 * DURATION, .tv_nsec = 0 };
+
+  running = 1;
+  pthread_create(&thread, NULL, nanosleeper, &req);
+  real_sleep(DURATION * scale);
+
+  double start = real_now();
+  timescaler_advance(100 * DURATION * 1000000000L);
+  pthread_join(thread, NULL);
+  return real_now() - start;
+}
+
+
+/**
+ * Measure the real time an absolute sleep, made while the clocks are paused,
+ * takes to end after they are resumed
+ * @param held: set to 1 if the sleep was still running before the resume
+ * @return the real time in seconds
+ */
+static double resume_wakeup(int *held)
+{
+  pthread_t thread;
+  struct timespec deadline;
+
+  timescaler_pause();
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += DURATION * 1000000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+
+  running = 1;
+  pthread_create(&thread, NULL, abssleeper, &deadline);
+  real_sleep(2 * DURATION * scale);
+  *held = running;
+
+  double start = real_now();
+  timescaler_resume();
+  pthread_join(thread, NULL);
+  return real_now() - start;
+}
+
+
+static void test_api(void)
+{
+  if(!timescaler_is_loaded())
+  {
+    printf("[SKIP] %-24s scale=%-5.2f\n", "api", scale);
+    return;
+  }
+
+  check_true("api get_scale", timescaler_get_scale() == scale);
+
+  timescaler_pause();
+  double start = scaled_now();
+  real_sleep(DURATION * scale);
+  check("api pause", scaled_now() - start, 0.0);
+
+  timescaler_advance(DURATION * 1000000000L);
+  check("api advance", scaled_now() - start, DURATION);
+  timescaler_resume();
+
+  timescaler_set_scale(scale * 2);
+  CHECK("api set_scale", scaled_elapsed(CLOCK_MONOTONIC, DURATION * scale),
+        DURATION / 2);
+  timescaler_set_scale(scale);
+
+  /* The sleeping threads follow the scaled clocks */
+  int held;
+  CHECK("api advance sleep", advance_wakeup(), 0.0);
+  CHECK("api resume sleep", resume_wakeup(&held), DURATION * scale);
+  check_true("api pause sleep", held);
+
+  struct timespec tp;
+  timescaler_now_real(CLOCK_MONOTONIC, &tp);
+  check_true("api now_real",
+             fabs(tp.tv_sec + tp.tv_nsec / 1e9 - real_now()) < 0.001);
+}
+
+
+/**
+ * Wait for a child for at most one second
+ * @param pid: the child
+ * @return 1 if the child exited successfully, 0 otherwise
+ */
+static int wait_child(pid_t pid)
+{
+  double end = real_now() + 1.0;
+  int status;
+
+  while(real_now() < end)
+  {
+    if(waitpid(pid, &status, WNOHANG) == pid)
+      return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    real_sleep(0.001);
+  }
+
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  return 0;
+}
+
+
+/**
+ * Check the environment and the clocks of a child, run as:
+ * accuracy --child|--paused-child <scale> <scaled time> <real time>
+ * with the monotonic times read by the parent just before creating the child
+ */
+static int run_child(char *argv[])
+{
+  const char *psz_scale = getenv("TIMESCALER_SCALE");
+  if(!timescaler_is_loaded() || !psz_scale || atof(psz_scale) != atof(argv[2]))
+    return 1;
+
+  /* The scaled clock continues the one of the parent or stays paused */
+  double now, expected;
+  if(!strcmp(argv[1], "--paused-child"))
+  {
+    real_sleep(0.05);
+    now = scaled_now();
+    expected = atof(argv[3]);
+  }
+  else
+  {
+    now = scaled_now();
+    expected = atof(argv[3]) + (real_now() - atof(argv[4])) / atof(argv[2]);
+  }
+  return fabs(now - expected) > 0.01;
+}
+
+
+/**
+ * Build the arguments of a child checking its environment
+ * @param argv: the arguments
+ * @param psz_scale: the scale expected by the child
+ * @param paused: 1 if the scaled clocks are paused
+ * @param psz_times: buffer for the current scaled and real times
+ */
+static void child_argv(char *argv[6], char *psz_scale, int paused,
+                       char psz_times[2][32])
+{
+  sprintf(psz_times[0], "%.9f", scaled_now());
+  sprintf(psz_times[1], "%.9f", real_now());
+
+  argv[0] = psz_self;
+  argv[1] = paused ? "--paused-child" : "--child";
+  argv[2] = psz_scale;
+  argv[3] = psz_times[0];
+  argv[4] = psz_times[1];
+  argv[5] = NULL;
+}
+
+
+/**
+ * Spawn a child without any environment, run as: accuracy --spawn <scale>
+ */
+static int run_spawn(char *psz_expected)
+{
+  char *argv[6], psz_times[2][32];
+  char *envp[] = { NULL };
+  pid_t pid;
+
+  child_argv(argv, psz_expected, 0, psz_times);
+  if(posix_spawn(&pid, psz_self, NULL, NULL, argv, envp))
+    return 1;
+  return !wait_child(pid);
+}
+
+
+/**
+ * Run the test binary as a child checking its environment, with one of the
+ * exec functions and a scrubbed environment
+ * @param psz_func: the exec function, or chdir to run execve from "/"
+ * @param psz_scale: the scale expected by the child
+ * @param paused: 1 if the scaled clocks are paused
+ * @return 1 if the child got the configuration, 0 otherwise
+ */
+static int exec_child(const char *psz_func, char *psz_scale, int paused)
+{
+  extern int execvpe(const char *, char *const [], char *const []);
+  char *argv[6], psz_times[2][32];
+  char *envp[] = { NULL };
+  pid_t pid;
+
+  child_argv(argv, psz_scale, paused, psz_times);
+  if(!strcmp(psz_func, "posix_spawn"))
+    return !posix_spawn(&pid, psz_self, NULL, NULL, argv, envp) &&
+           wait_child(pid);
+
+  pid = fork();
+  if(!pid)
+  {
+    clearenv();
+    if(!strcmp(psz_func, "chdir"))
+    {
+      /* The library might be preloaded with a relative path */
+      if(!chdir("/"))
+        execve(psz_self, argv, envp);
+    }
+    else if(!strcmp(psz_func, "execl"))
+      execl(psz_self, argv[0], argv[1], argv[2], argv[3], argv[4], (char *)NULL);
+    else if(!strcmp(psz_func, "execle"))
+      execle(psz_self, argv[0], argv[1], argv[2], argv[3], argv[4], (char *)NULL,
+             envp);
+    else if(!strcmp(psz_func, "execlp"))
+      execlp(psz_self, argv[0], argv[1], argv[2], argv[3], argv[4], (char *)NULL);
+    else if(!strcmp(psz_func, "execv"))
+      execv(psz_self, argv);
+    else if(!strcmp(psz_func, "execve"))
+      execve(psz_self, argv, envp);
+    else if(!strcmp(psz_func, "execvp"))
+      execvp(psz_self, argv);
+    else if(!strcmp(psz_func, "execvpe"))
+      execvpe(psz_self, argv, envp);
+    else if(!strcmp(psz_func, "system"))
+    {
+      char psz_command[strlen(psz_self) + 128];
+      sprintf(psz_command, "%s %s %s %s %s", argv[0], argv[1], argv[2],
+              argv[3], argv[4]);
+      int status = system(psz_command);
+      _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+    }
+    _exit(1);
+  }
+  return wait_child(pid);
+}
+
+
+/**
+ * Run a command with system in a loop
+ */
+static void *shell(void *data)
+{
+  unsigned i;
+  for(i = 0; i < 20; i++)
+    system((const char *)data);
+  return NULL;
+}
+
+
+static void test_exec(void)
+{
+  char *psz_scale = getenv("TIMESCALER_SCALE");
+  if(!psz_scale)
+  {
+    printf("[SKIP] %-24s scale=%-5.2f\n", "exec", scale);
+    return;
+  }
+
+  /* The parent scrubs the environment of the children */
+  const char *ppsz_funcs[] = { "posix_spawn", "execl", "execle", "execlp",
+                               "execv", "execve", "execvp", "execvpe",
+                               "system", "chdir" };
+  unsigned i;
+  for(i = 0; i < sizeof(ppsz_funcs) / sizeof(ppsz_funcs[0]); i++)
+  {
+    char psz_name[32];
+    sprintf(psz_name, "%s environ", ppsz_funcs[i]);
+    check_true(psz_name, exec_child(ppsz_funcs[i], psz_scale, 0));
+  }
+
+  /* Concurrent calls to system restore the signal handlers of the process */
+  struct sigaction action, current;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+
+  pthread_t threads[THREADS];
+  for(i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, shell, "sleep 0.01");
+  for(i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  sigaction(SIGINT, NULL, &current);
+  check_true("system threads", current.sa_handler == on_signal);
+  action.sa_handler = SIG_DFL;
+  sigaction(SIGINT, &action, NULL);
+
+  /* The children get the scale set at runtime */
+  if(timescaler_is_loaded())
+  {
+    char psz_new_scale[32];
+    sprintf(psz_new_scale, "%.17g", scale * 2);
+    timescaler_set_scale(scale * 2);
+    check_true("exec set_scale", exec_child("execve", psz_new_scale, 0));
+    timescaler_set_scale(scale);
+
+    timescaler_pause();
+    check_true("exec pause", exec_child("execve", psz_scale, 1));
+    timescaler_resume();
+  }
+
+  /* The children of a process with a rules file get the scale of the rule */
+  char psz_rules[] = "/tmp/timescaler-rules-XXXXXX";
+  int fd = mkstemp(psz_rules);
+  FILE *file = fdopen(fd, "w");
+  const char *psz_program = strrchr(psz_self, '/');
+  fprintf(file, "# Rules of the test suite\n%s TIMESCALER_SCALE=3\n",
+          psz_program ? psz_program + 1 : psz_self);
+  fclose(file);
+
+  char psz_rules_var[sizeof("TIMESCALER_RULES=") + sizeof(psz_rules)];
+  sprintf(psz_rules_var, "TIMESCALER_RULES=%s", psz_rules);
+  char *argv_spawn[] = { psz_self, "--spawn", "3", NULL };
+  char *envp_spawn[] = { psz_rules_var, NULL };
+
+  pid_t pid = fork();
+  if(!pid)
+  {
+    execve(psz_self, argv_spawn, envp_spawn);
+    _exit(1);
+  }
+  check_true("exec rules", wait_child(pid));
+  unlink(psz_rules);
+}
+
+
+/**
+ * Re-anchor the clocks in a loop
+ */
+static void *reanchor(void *data)
+{
+  (void)data;
+  while(running)
+    timescaler_set_scale(scale);
+  return NULL;
+}
+
+
+static void test_fork(void)
+{
+  if(!timescaler_is_loaded())
+  {
+    printf("[SKIP] %-24s scale=%-5.2f\n", "fork", scale);
+    return;
+  }
+
+  /* The children should not inherit a lock held by the other thread */
+  pthread_t thread;
+  unsigned i, ok = 1;
+
+  running = 1;
+  pthread_create(&thread, NULL, reanchor, NULL);
+  for(i = 0; i < 20; i++)
+  {
+    pid_t pid = fork();
+    if(!pid)
+    {
+      struct timespec tp;
+      timescaler_set_scale(scale);
+      clock_gettime(CLOCK_MONOTONIC, &tp);
+      _exit(0);
+    }
+    ok &= wait_child(pid);
+  }
+  running = 0;
+  pthread_join(thread, NULL);
+
+  check_true("fork", ok);
+}
+
+
+int main(int argc, char *argv[])
+{
+  /* The children are also executed from another working directory */
+  psz_self = realpath(argv[0], NULL);
+  if(argc == 5 && (!strcmp(argv[1], "--child") ||
+                   !strcmp(argv[1], "--paused-child")))
+    return run_child(argv);
+  if(argc == 3 && !strcmp(argv[1], "--spawn"))
+    return run_spawn(argv[2]);
+
+  const char *psz_scale = getenv("TIMESCALER_SCALE");
+  if(psz_scale)
+    scale = atof(psz_scale);
+
+  /* Keep the output in order with the logs of timescaler */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  /* SIGALRM is waited for synchronously and SIGUSR1 interrupts the calls */
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGALRM);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGUSR1, &action, NULL);
+  main_thread = pthread_self();
+
+  test_alarm();
+  test_clock_gettime();
+  test_clock_nanosleep();
+  test_epoll();
+  test_futex();
+  test_itimer();
+  test_gettimeofday();
+  test_nanosleep();
+  test_poll();
+  test_select();
+  test_sleep();
+  test_time();
+  test_times();
+  test_ualarm();
+  test_usleep();
+  test_precision();
+  test_monotonic();
+  test_api();
+  test_exec();
+  test_fork();
+
+  printf("%u failure(s) with scale=%.2f\n", failures, scale);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+/*****************************************************************************
+ * Copyright (C) 2012 Rémi Duraffort
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/**
+ * Measure the real time spent in the sleeping functions compared to the
+ * requested time scaled by TIMESCALER_SCALE. Should be run with timescaler
+ * preloaded.
+ */
+
+#include <stdio.h>          /* printf */
+#include <stdlib.h>         /* atof, getenv */
+#include <sys/syscall.h>    /* SYS_clock_gettime */
+#include <time.h>           /* clock_nanosleep, nanosleep */
+#include <unistd.h>         /* syscall */
+
+#define ITERATIONS 200
+
+static const long durations[] = { 1000, 5000, 10000, 50000, 100000, 500000,
+                                  1000000 };
+
+
+/**
+ * Read the real monotonic clock, bypassing the hooks and the vDSO
+ * @return the time in nanoseconds
+ */
+static long long real_now(void)
+{
+  struct timespec tp;
+  syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec * 1000000000LL + tp.tv_nsec;
+}
+
+
+static int do_nanosleep(const struct timespec *req)
+{
+  return nanosleep(req, NULL);
+}
+
+
+static int do_clock_nanosleep(const struct timespec *req)
+{
+  return clock_nanosleep(CLOCK_MONOTONIC, 0, req, NULL);
+}
+
+
+static void bench(const char *psz_name, int (*func)(const struct timespec *),
+                  double scale)
+{
+  unsigned i, j;
+
+  for(i = 0; i < sizeof(durations) / sizeof(durations[0]); i++)
+  {
+    struct timespec req = { .tv_sec = 0, .tv_nsec = durations[i] };
+    double requested = durations[i] * scale;
+    double total = 0.0;
+
+    for(j = 0; j < ITERATIONS; j++)
+    {
+      long long start = real_now();
+      func(&req);
+      total += real_now() - start;
+    }
+
+    double achieved = total / ITERATIONS;
+    printf("%-16s %8.2f %10ld %12.0f %12.0f %+12.0f %+9.1f%%\n", psz_name,
+           scale, durations[i], requested, achieved, achieved - requested,
+           100.0 * (achieved - requested) / requested);
+  }
+}
+
+
+int main(void)
+{
+  const char *psz_scale = getenv("TIMESCALER_SCALE");
+  const char *psz_precision = getenv("TIMESCALER_PRECISION");
+  double scale = psz_scale ? atof(psz_scale) : 1.0;
+
+  printf("# precision=%s\n", psz_precision ? psz_precision : "0");
+  printf("# %-14s %8s %10s %12s %12s %12s %10s\n", "function", "scale",
+         "virtual", "requested", "achieved", "error", "error");
+  bench("nanosleep", do_nanosleep, scale);
+  bench("clock_nanosleep", do_clock_nanosleep, scale);
+
+  return 0;
+}
@@ -16,33 +16,70 @@
  *****************************************************************************/
 
 #include <errno.h>
+#include <limits.h>         /* INT_MAX */
 #include <linux/futex.h>    /* futex */
 #include <math.h>           /* floor */
 #include <poll.h>           /* poll */
+#include <pthread.h>        /* pthread_atfork, pthread_mutex_lock */
+#include <signal.h>         /* sigaction, sigprocmask */
+#include <spawn.h>          /* posix_spawn, posix_spawnp */
 #include <stdarg.h>         /* va_list, va_args */
-#include <stdlib.h>         /* atof, atoi, getenv, free */
-#include <stdio.h>          /* fprintf, stderr, vfprintf */
-#include <string.h>         /* memset, strstr */
+#include <stdlib.h>         /* atof, atoi, getenv, free, realpath, system */
+#include <stdio.h>          /* fopen, fprintf, getline, stderr, vfprintf */
+#include <string.h>         /* memset, strcspn, strrchr, strstr */
 #include <sys/epoll.h>      /* epoll_pwait, epoll_wait */
+#include <sys/prctl.h>      /* prctl, PR_SET_TIMERSLACK */
 #include <sys/select.h>     /* pselect, select */
+#include <sys/syscall.h>    /* SYS_futex, SYS_ppoll */
 #include <sys/time.h>       /* getitimer, gettimeofday, setitimer */
 #include <sys/times.h>      /* times */
+#include <sys/wait.h>       /* waitpid */
 #include <time.h>           /* clock_gettime, clock_nanosleep, nanosleep, time */
-#include <unistd.h>         /* alarm, sleep, ualarm, usleep */
+#include <unistd.h>         /* alarm, exec*, sleep, ualarm, usleep */
 
-#define __USE_GNU
-#include <dlfcn.h>          /* dlsym */
+#ifndef TIMESCALER_WRAP
+# define __USE_GNU
+# include <dlfcn.h>         /* dladdr, dlsym */
+#endif
+
+#define TIMESCALER_NO_WEAK
+#include "timescaler.h"
+
+
+/**
+ * glibc 2.31 changed the second argument of gettimeofday to a void pointer
+ */
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 31)
+typedef void *timezone_ptr_t;
+#else
+typedef struct timezone *timezone_ptr_t;
+#endif
+
+
+/**
+ * By default, timescaler is preloaded and the original functions are resolved
+ * with dlsym at initialization.
+ * With TIMESCALER_WRAP, timescaler is linked into the program with the --wrap
+ * option of the linker: the hooks are named __wrap_<func> and the original
+ * functions are called directly through __real_<func>.
+ */
+#ifdef TIMESCALER_WRAP
+# define HOOKED(func) __wrap_##func
+# define REAL(func)   __real_##func
+#else
+# define HOOKED(func) func
+# define REAL(func)   ts_config.funcs.func
+#endif
 
 
 /**
- * Hide most symboles by default and export only the hooks
+ * Export only the hooks and the API, everything else is static so that it does
+ * not clash with the symbols of the program when linked with --wrap
  */
 #if __GNUC__ >= 4
-# define LOCAL  __attribute__ ((visibility ("hidden")))
 # define GLOBAL __attribute__ ((visibility ("default")))
 #else
 # define GLOBAL
-# define LOCAL
 #endif
 
 
@@ -61,19 +98,92 @@
 #define TIMESCALER_VERSION_MINOR 3
 
 
+/**
+ * The configuration variables given to the children, as read at
+ * initialization. The scale and the clock anchor are computed for every child.
+ */
+static const char *ppsz_config_vars[] =
+{
+  "TIMESCALER_VERBOSITY",
+  "TIMESCALER_HOOKS",
+  "TIMESCALER_PRECISION",
+  "TIMESCALER_TIMERSLACK",
+  "TIMESCALER_SPIN",
+  "TIMESCALER_RULES"
+};
+
+#define CONFIG_VARS (sizeof(ppsz_config_vars) / sizeof(ppsz_config_vars[0]))
+
+
+/**
+ * Environment variables set for the children running a given program
+ */
+typedef struct
+{
+  char *psz_program;
+  char **ppsz_vars;
+  unsigned count;
+} exec_rule;
+
+
+/**
+ * State of the scaled clocks given to a child: the current scale, the real
+ * and scaled times of both clocks and the pause state, so that the child
+ * continues them
+ */
+typedef struct
+{
+  char psz_scale[sizeof("TIMESCALER_SCALE=") + 32];
+  char psz_anchor[sizeof("TIMESCALER_ANCHOR=") + 4 * 24 + 2];
+} child_clocks;
+
+
 /**
  * Global configuration
  */
-LOCAL struct {
+static struct {
   int initialized;
   unsigned verbosity;
-  float scale;
+  double scale;
+
+  // Precision mode for short sleeps
+  struct {
+    int enabled;
+    unsigned long timerslack;
+    double spin;
+  } precision;
+
+  // References of the scaled clocks, protected by a sequence lock:
+  // scaled = scaled_ref + (real - real_ref) / scale
+  struct {
+    pthread_mutex_t lock;
+    unsigned sequence;
+    int paused;
+    struct {
+      long long real;
+      long long scaled;
+    } realtime, monotonic;
+  } anchor;
+
+  // Environment given to the children
+  struct {
+    char *ppsz_vars[CONFIG_VARS];
+    char *psz_preload;
+    exec_rule *rules;
+    unsigned rules_count;
+  } children;
+
+  // Signal handlers of the process while system is running in some threads
+  struct {
+    pthread_mutex_t lock;
+    unsigned count;
+    struct sigaction intr, quit;
+  } shell;
 
   // Initial value for some functions
   struct {
-    int time;
-    int clock_monotonic;
-    int clock_realtime;
+    long long monotonic;
+    long clock_ticks;
     clock_t times;
   } initial;
 
@@ -84,21 +194,32 @@ LOCAL struct {
     int clock_nanosleep:1;
     int epoll_pwait:1;
     int epoll_wait:1;
+    int execl:1;
+    int execle:1;
+    int execlp:1;
+    int execv:1;
+    int execve:1;
+    int execvp:1;
+    int execvpe:1;
     int futex:1;
     int getitimer:1;
     int gettimeofday:1;
     int nanosleep:1;
     int pselect:1;
     int poll:1;
+    int posix_spawn:1;
+    int posix_spawnp:1;
     int select:1;
     int setitimer:1;
     int sleep:1;
+    int system:1;
     int time:1;
     int times:1;
     int ualarm:1;
     int usleep:1;
   } hooks;
 
+#ifndef TIMESCALER_WRAP
   // Pointer to the original functions
   struct {
     unsigned int  (*alarm)(unsigned int);
@@ -109,26 +230,98 @@ LOCAL struct {
     int           (*epoll_pwait)(int, struct epoll_event *, int, int,
                                  const __sigset_t *);
     int           (*epoll_wait)(int, struct epoll_event *, int, int);
+    int           (*execv)(const char *, char *const []);
+    int           (*execve)(const char *, char *const [], char *const []);
+    int           (*execvp)(const char *, char *const []);
+    int           (*execvpe)(const char *, char *const [], char *const []);
     int           (*futex)(int *, int, int, const struct timespec *, int *, int);
     int           (*getitimer)(int, struct itimerval *);
-    int           (*gettimeofday)(struct timeval *, struct timezone *);
+    int           (*gettimeofday)(struct timeval *, timezone_ptr_t);
     int           (*nanosleep)(const struct timespec *, struct timespec *);
     int           (*poll)(struct pollfd *, nfds_t, int);
+    int           (*posix_spawn)(pid_t *, const char *,
+                                 const posix_spawn_file_actions_t *,
+                                 const posix_spawnattr_t *, char *const [],
+                                 char *const []);
+    int           (*posix_spawnp)(pid_t *, const char *,
+                                  const posix_spawn_file_actions_t *,
+                                  const posix_spawnattr_t *, char *const [],
+                                  char *const []);
     int           (*pselect)(int nfds, fd_set *, fd_set *, fd_set *,
                              const struct timespec *, const sigset_t *);
     int           (*select)(int nfds, fd_set *, fd_set *, fd_set *,
                             struct timeval *);
     int           (*setitimer)(int, const struct itimerval *, struct itimerval *);
     unsigned int  (*sleep)(unsigned int);
+    int           (*system)(const char *);
     time_t        (*time)(time_t*);
     clock_t       (*times)(struct tms *);
     useconds_t    (*ualarm)(useconds_t, useconds_t);
     int           (*usleep)(useconds_t);
   } funcs;
+#endif
 
 } ts_config = { .initialized = 0,
                 .verbosity = 1,
-                .scale = 1.0f };
+                .scale = 1.0,
+                .anchor = { .lock = PTHREAD_MUTEX_INITIALIZER },
+                .shell = { .lock = PTHREAD_MUTEX_INITIALIZER },
+                .precision = { .enabled = 0,
+                               .timerslack = 1,
+                               .spin = 0.00005 } };
+
+
+#ifdef TIMESCALER_WRAP
+/**
+ * The original functions, resolved by the linker
+ */
+unsigned int  __real_alarm(unsigned int);
+int           __real_clock_gettime(clockid_t, struct timespec *);
+int           __real_clock_nanosleep(clockid_t, int, const struct timespec *,
+                                     struct timespec *);
+int           __real_epoll_pwait(int, struct epoll_event *, int, int,
+                                 const __sigset_t *);
+int           __real_epoll_wait(int, struct epoll_event *, int, int);
+int           __real_execv(const char *, char *const []);
+int           __real_execve(const char *, char *const [], char *const []);
+int           __real_execvp(const char *, char *const []);
+int           __real_execvpe(const char *, char *const [], char *const []);
+int           __real_getitimer(int, struct itimerval *);
+int           __real_gettimeofday(struct timeval *, timezone_ptr_t);
+int           __real_nanosleep(const struct timespec *, struct timespec *);
+int           __real_poll(struct pollfd *, nfds_t, int);
+int           __real_posix_spawn(pid_t *, const char *,
+                                 const posix_spawn_file_actions_t *,
+                                 const posix_spawnattr_t *, char *const [],
+                                 char *const []);
+int           __real_posix_spawnp(pid_t *, const char *,
+                                  const posix_spawn_file_actions_t *,
+                                  const posix_spawnattr_t *, char *const [],
+                                  char *const []);
+int           __real_pselect(int nfds, fd_set *, fd_set *, fd_set *,
+                             const struct timespec *, const sigset_t *);
+int           __real_select(int nfds, fd_set *, fd_set *, fd_set *,
+                            struct timeval *);
+int           __real_setitimer(int, const struct itimerval *, struct itimerval *);
+unsigned int  __real_sleep(unsigned int);
+int           __real_system(const char *);
+time_t        __real_time(time_t*);
+clock_t       __real_times(struct tms *);
+useconds_t    __real_ualarm(useconds_t, useconds_t);
+int           __real_usleep(useconds_t);
+
+# define __real_futex timescaler_futex
+#endif
+
+
+/**
+ * The libc does not provide futex: call the system call directly
+ */
+static int timescaler_futex(int *uaddr, int op, int val,
+                           const struct timespec *timeout, int *uaddr2, int val3)
+{
+  return syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3);
+}
 
 
 /**
@@ -155,6 +348,37 @@ static const char *psz_log_level[] =
     timescaler_init();                              \
   timescaler_log(DEBUG, "Calling '%s'", __func__);
 
+/**
+ * Declare and build the environment of a child on the stack, as the exec
+ * functions might be called after vfork
+ */
+#define CHILD_ENVIRON(new_envp, path, envp)                                   \
+  size_t preload_size_;                                                       \
+  size_t size_ = timescaler_environ_size(path, envp, &preload_size_);         \
+  char *new_envp[size_];                                                      \
+  char psz_preload_[preload_size_];                                           \
+  child_clocks clocks_;                                                       \
+  timescaler_environ(path, envp, new_envp, psz_preload_, &clocks_)
+
+/**
+ * Declare the array of arguments given to the execl functions, args is left
+ * after the NULL pointer ending the list
+ */
+#define EXECL_ARGV(argv, arg, args)                                           \
+  unsigned argc_ = 1, i_;                                                     \
+  va_start(args, arg);                                                        \
+  while(va_arg(args, char *))                                                 \
+    argc_++;                                                                  \
+  va_end(args);                                                               \
+  char *argv[argc_ + 1];                                                      \
+  argv[0] = (char *)arg;                                                      \
+  va_start(args, arg);                                                        \
+  for(i_ = 1; i_ <= argc_; i_++)                                              \
+    argv[i_] = va_arg(args, char *)
+
+/** The environment of the process, used by the exec functions without envp */
+extern char **environ;
+
 
 /**
  * Logging function for the timescaler library
@@ -162,7 +386,7 @@ static const char *psz_log_level[] =
  * @param psz_fmt: the message to print
  * @return nothing
  */
-LOCAL inline void timescaler_log(log_level level, const char *psz_fmt, ...)
+static inline void timescaler_log(log_level level, const char *psz_fmt, ...)
 {
   if(unlikely(level <= ts_config.verbosity))
   {
@@ -178,11 +402,121 @@ LOCAL inline void timescaler_log(log_level level, const char *psz_fmt, ...)
 }
 
 
+/**
+ * Transform a timespec structure to nanoseconds
+ * @param t: the timespec structure
+ * @return the time in nanoseconds
+ */
+static inline long long timespec2ns(const struct timespec *t)
+{
+  return t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+
+/**
+ * Transform nanoseconds into a timespec structure
+ * @param ns: the time in nanoseconds
+ * @param t: the timespec structure
+ */
+static inline void ns2timespec(long long ns, struct timespec *t)
+{
+  t->tv_sec = ns / 1000000000LL;
+  t->tv_nsec = ns % 1000000000LL;
+  if(t->tv_nsec < 0)
+  {
+    t->tv_sec--;
+    t->tv_nsec += 1000000000LL;
+  }
+}
+
+
+/**
+ * Load the rules giving the environment variables of the children running a
+ * given program. Each line of the file is made of the name of the program
+ * followed by a list of VARIABLE=value. Empty lines and lines starting with
+ * '#' are ignored.
+ * @param psz_file: the path to the rules file
+ */
+static void timescaler_load_rules(const char *psz_file)
+{
+  FILE *file = fopen(psz_file, "r");
+  if(!file)
+  {
+    timescaler_log(ERROR, "Unable to open the rules file '%s'", psz_file);
+    return;
+  }
+
+  char *psz_line = NULL;
+  size_t size = 0;
+  while(getline(&psz_line, &size, file) != -1)
+  {
+    char *save_ptr, *token;
+
+    token = strtok_r(psz_line, " \t\n", &save_ptr);
+    if(!token || *token == '#')
+      continue;
+
+    exec_rule *rules = realloc(ts_config.children.rules,
+                               (ts_config.children.rules_count + 1) * sizeof(*rules));
+    if(!rules)
+      break;
+    ts_config.children.rules = rules;
+
+    exec_rule *rule = &rules[ts_config.children.rules_count++];
+    rule->psz_program = strdup(token);
+    rule->ppsz_vars = NULL;
+    rule->count = 0;
+    timescaler_log(DEBUG, "Rule for '%s':", rule->psz_program);
+
+    while((token = strtok_r(NULL, " \t\n", &save_ptr)))
+    {
+      if(!strchr(token, '=') || *token == '=')
+      {
+        timescaler_log(ERROR, "Invalid variable '%s' in the rules file", token);
+        continue;
+      }
+
+      char **ppsz_vars = realloc(rule->ppsz_vars,
+                                 (rule->count + 1) * sizeof(*ppsz_vars));
+      if(!ppsz_vars)
+        break;
+      rule->ppsz_vars = ppsz_vars;
+      rule->ppsz_vars[rule->count++] = strdup(token);
+      timescaler_log(DEBUG, " * %s", token);
+    }
+  }
+
+  free(psz_line);
+  fclose(file);
+}
+
+
+/**
+ * Lock the clock references and the state of system before forking so that
+ * the child does not inherit a lock held by another thread
+ */
+static void timescaler_atfork_prepare(void)
+{
+  pthread_mutex_lock(&ts_config.shell.lock);
+  pthread_mutex_lock(&ts_config.anchor.lock);
+}
+
+
+/**
+ * Release the locks after forking, in the parent and the child
+ */
+static void timescaler_atfork_release(void)
+{
+  pthread_mutex_unlock(&ts_config.anchor.lock);
+  pthread_mutex_unlock(&ts_config.shell.lock);
+}
+
+
 /**
  * Constructor function that read the environment variables
  * and get the right initial time
  */
-LOCAL void __attribute__ ((constructor)) timescaler_init(void)
+static void __attribute__ ((constructor)) timescaler_init(void)
 {
   /*
     The constructor function is not always the first function to be called.
@@ -204,6 +538,18 @@ LOCAL void __attribute__ ((constructor)) timescaler_init(void)
   if(psz_scale)
     ts_config.scale = atof(psz_scale);
 
+  const char *psz_precision = getenv("TIMESCALER_PRECISION");
+  if(psz_precision)
+    ts_config.precision.enabled = atoi(psz_precision);
+
+  const char *psz_timerslack = getenv("TIMESCALER_TIMERSLACK");
+  if(psz_timerslack)
+    ts_config.precision.timerslack = strtoul(psz_timerslack, NULL, 10);
+
+  const char *psz_spin = getenv("TIMESCALER_SPIN");
+  if(psz_spin)
+    ts_config.precision.spin = atof(psz_spin) / 1000000000L;
+
   const char *psz_hooks = getenv("TIMESCALER_HOOKS");
   if(psz_hooks && !*psz_hooks)
   {
@@ -227,15 +573,25 @@ LOCAL void __attribute__ ((constructor)) timescaler_init(void)
       else HOOK(clock_nanosleep)
       else HOOK(epoll_pwait)
       else HOOK(epoll_wait)
+      else HOOK(execl)
+      else HOOK(execle)
+      else HOOK(execlp)
+      else HOOK(execv)
+      else HOOK(execve)
+      else HOOK(execvp)
+      else HOOK(execvpe)
       else HOOK(futex)
       else HOOK(getitimer)
       else HOOK(gettimeofday)
       else HOOK(nanosleep)
       else HOOK(pselect)
       else HOOK(poll)
+      else HOOK(posix_spawn)
+      else HOOK(posix_spawnp)
       else HOOK(select)
       else HOOK(setitimer)
       else HOOK(sleep)
+      else HOOK(system)
       else HOOK(time)
       else HOOK(times)
       else HOOK(ualarm)
@@ -253,6 +609,7 @@ LOCAL void __attribute__ ((constructor)) timescaler_init(void)
     memset(&ts_config.hooks, -1, sizeof(ts_config.hooks));
   }
 
+#ifndef TIMESCALER_WRAP
   /* Resolve the symbols that we will need afterward */
 #define HOOK(name) ts_config.funcs.name = dlsym(RTLD_NEXT, #name)
   HOOK(alarm);
@@ -260,39 +617,108 @@ LOCAL void __attribute__ ((constructor)) timescaler_init(void)
   HOOK(clock_nanosleep);
   HOOK(epoll_pwait);
   HOOK(epoll_wait);
+  HOOK(execv);
+  HOOK(execve);
+  HOOK(execvp);
+  HOOK(execvpe);
   HOOK(futex);
   HOOK(getitimer);
   HOOK(gettimeofday);
   HOOK(nanosleep);
   HOOK(pselect);
   HOOK(poll);
+  HOOK(posix_spawn);
+  HOOK(posix_spawnp);
   HOOK(select);
   HOOK(setitimer);
   HOOK(sleep);
+  HOOK(system);
   HOOK(time);
   HOOK(times);
   HOOK(ualarm);
   HOOK(usleep);
 #undef HOOK
 
-  /* Get some time references */
-  ts_config.initial.time = ts_config.funcs.time(NULL);
+  if(!ts_config.funcs.futex)
+    ts_config.funcs.futex = timescaler_futex;
 
-  if(ts_config.funcs.clock_gettime)
+  /* The children should preload the same library, even from another
+     working directory */
+  Dl_info info;
+  if(dladdr((void *)timescaler_init, &info) && info.dli_fname)
   {
-    struct timespec tp;
-    ts_config.funcs.clock_gettime(CLOCK_REALTIME, &tp);
-    ts_config.initial.clock_realtime = tp.tv_sec;
-    ts_config.funcs.clock_gettime(CLOCK_MONOTONIC, &tp);
-    ts_config.initial.clock_monotonic = tp.tv_sec;
+    ts_config.children.psz_preload = realpath(info.dli_fname, NULL);
+    if(!ts_config.children.psz_preload)
+      ts_config.children.psz_preload = strdup(info.dli_fname);
   }
+#endif
+
+  /* Save the configuration given to the children */
+  unsigned i;
+  for(i = 0; i < CONFIG_VARS; i++)
+  {
+    const char *psz_value = getenv(ppsz_config_vars[i]);
+    if(!psz_value)
+      continue;
+
+    char *psz_var = malloc(strlen(ppsz_config_vars[i]) + strlen(psz_value) + 2);
+    if(psz_var)
+      sprintf(psz_var, "%s=%s", ppsz_config_vars[i], psz_value);
+    ts_config.children.ppsz_vars[i] = psz_var;
+  }
+
+  const char *psz_rules = getenv("TIMESCALER_RULES");
+  if(psz_rules && *psz_rules)
+    timescaler_load_rules(psz_rules);
+
+  pthread_atfork(timescaler_atfork_prepare, timescaler_atfork_release,
+                 timescaler_atfork_release);
+
+  /* Get some time references */
+  struct timespec tp;
+  REAL(clock_gettime)(CLOCK_REALTIME, &tp);
+  long long realtime = timespec2ns(&tp);
+  REAL(clock_gettime)(CLOCK_MONOTONIC, &tp);
+  long long monotonic = timespec2ns(&tp);
+
+  /* A child continues the scaled clocks of its parent, paused or not */
+  const char *psz_anchor = getenv("TIMESCALER_ANCHOR");
+  if(psz_anchor && *psz_anchor &&
+     sscanf(psz_anchor, "%lld:%lld:%lld:%lld:%d",
+            &ts_config.anchor.realtime.real, &ts_config.anchor.realtime.scaled,
+            &ts_config.anchor.monotonic.real,
+            &ts_config.anchor.monotonic.scaled, &ts_config.anchor.paused) == 5)
+    timescaler_log(DEBUG, "Continuing the clocks of the parent%s",
+                   ts_config.anchor.paused ? " (paused)" : "");
+  else
+  {
+    if(psz_anchor && *psz_anchor)
+      timescaler_log(ERROR, "Invalid anchor '%s'", psz_anchor);
+    ts_config.anchor.paused = 0;
+    ts_config.anchor.realtime.real = realtime;
+    ts_config.anchor.realtime.scaled = realtime;
+    ts_config.anchor.monotonic.real = monotonic;
+    ts_config.anchor.monotonic.scaled = monotonic;
+  }
+
   struct tms dummy;
-  ts_config.initial.times = ts_config.funcs.times(&dummy);
+  ts_config.initial.monotonic = ts_config.anchor.monotonic.scaled;
+  if(!ts_config.anchor.paused)
+    ts_config.initial.monotonic += (monotonic - ts_config.anchor.monotonic.real) /
+                                   ts_config.scale;
+  ts_config.initial.clock_ticks = sysconf(_SC_CLK_TCK);
+  ts_config.initial.times = REAL(times)(&dummy);
 
   /* Print some informations about the configuration */
   timescaler_log(DEBUG, "Timescaler v%d.%d initialization finished with:", TIMESCALER_VERSION_MAJOR, TIMESCALER_VERSION_MINOR);
   timescaler_log(DEBUG, " * verbosity=%d", ts_config.verbosity);
   timescaler_log(DEBUG, " * scale=%f", ts_config.scale);
+  if(ts_config.precision.enabled)
+  {
+    timescaler_log(DEBUG, " * precision: timerslack=%luns spin=%.0fns",
+                   ts_config.precision.timerslack,
+                   ts_config.precision.spin * 1000000000L);
+  }
 }
 
 
@@ -301,7 +727,7 @@ LOCAL void __attribute__ ((constructor)) timescaler_init(void)
  * @param time: the time as a double
  * @param t: the timespec structure
  */
-LOCAL inline void double2timespec(double time, struct timespec *t)
+static inline void double2timespec(double time, struct timespec *t)
 {
   t->tv_sec = floor(time);
   t->tv_nsec = (time - t->tv_sec) * 1000000000L;
@@ -313,7 +739,7 @@ LOCAL inline void double2timespec(double time, struct timespec *t)
  * @param t: the timespec structure
  * @return the time as a double
  */
-LOCAL inline double timespec2double(const struct timespec *t)
+static inline double timespec2double(const struct timespec *t)
 {
   return t->tv_sec + (double)t->tv_nsec / 1000000000L;
 }
@@ -324,7 +750,7 @@ LOCAL inline double timespec2double(const struct timespec *t)
  * @param time: the time as a double
  * @param t: the timeval structure
  */
-LOCAL inline void double2timeval(double time, struct timeval *t)
+static inline void double2timeval(double time, struct timeval *t)
 {
   t->tv_sec = floor(time);
   t->tv_usec = (time - t->tv_sec) * 1000000L;
@@ -336,23 +762,360 @@ LOCAL inline void double2timeval(double time, struct timeval *t)
  * @param t: the timeval structure
  * @return the time as a double
  */
-LOCAL inline double timeval2double(const struct timeval *t)
+static inline double timeval2double(const struct timeval *t)
 {
   return t->tv_sec + (double)t->tv_usec / 1000000L;
 }
 
 
+/**
+ * Scale a timeval structure given to the timers. A non-zero time stays
+ * non-zero as a zero time would disarm the timer.
+ * @param t: the time seen by the program
+ * @param t_scale: the scaled time
+ */
+static inline void timescaler_scale_timeval(const struct timeval *t,
+                                            struct timeval *t_scale)
+{
+  double2timeval(timeval2double(t) * ts_config.scale, t_scale);
+  if(timerisset(t) && !timerisset(t_scale))
+    t_scale->tv_usec = 1;
+}
+
+
+/**
+ * Set the timer slack of the calling thread in precision mode. The timer
+ * slack is a per-thread attribute so this is done once in every thread that
+ * calls a waiting hook.
+ */
+static inline void timescaler_timerslack(void)
+{
+  static __thread int applied = 0;
+
+  if(unlikely(!applied) && ts_config.precision.enabled)
+  {
+    applied = 1;
+    /* A timer slack of 0 would reset the thread to the default value */
+    if(ts_config.precision.timerslack &&
+       prctl(PR_SET_TIMERSLACK, ts_config.precision.timerslack, 0, 0, 0))
+      timescaler_log(WARNING, "Unable to set the timer slack to %luns",
+                     ts_config.precision.timerslack);
+  }
+}
+
+
+/**
+ * Read the scaled time of the given clock. The references are read without
+ * locking and the read is retried if they were modified meanwhile.
+ * @param clk_id: CLOCK_REALTIME or CLOCK_MONOTONIC
+ * @param tp: the scaled time
+ * @return the return value of the original clock_gettime
+ */
+static int timescaler_scaled_time(clockid_t clk_id, struct timespec *tp)
+{
+  unsigned sequence;
+  long long scaled;
+
+  do
+  {
+    sequence = __atomic_load_n(&ts_config.anchor.sequence, __ATOMIC_ACQUIRE);
+
+    int return_value = REAL(clock_gettime)(clk_id, tp);
+    if(return_value)
+      return return_value;
+
+    if(clk_id == CLOCK_REALTIME)
+      scaled = ts_config.anchor.realtime.scaled;
+    else
+      scaled = ts_config.anchor.monotonic.scaled;
+
+    if(!ts_config.anchor.paused)
+    {
+      long long real = clk_id == CLOCK_REALTIME ? ts_config.anchor.realtime.real
+                                                : ts_config.anchor.monotonic.real;
+      scaled += (timespec2ns(tp) - real) / ts_config.scale;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while((sequence & 1) ||
+          sequence != __atomic_load_n(&ts_config.anchor.sequence, __ATOMIC_RELAXED));
+
+  ns2timespec(scaled, tp);
+  return 0;
+}
+
+
+/**
+ * Sleep until the scaled clock reaches the deadline. The thread waits on the
+ * sequence of the references so that it is woken up and re-computes the real
+ * time to wait when the clocks are paused, resumed, advanced or re-scaled. In
+ * precision mode, the end of the wait is spent spinning on the clock.
+ * @param clk_id: CLOCK_REALTIME or CLOCK_MONOTONIC
+ * @param deadline: the scaled deadline in nanoseconds
+ * @param rem: the remaining scaled time if interrupted (can be NULL)
+ * @return 0 or the error number, like clock_nanosleep
+ */
+static int timescaler_sleep_until(clockid_t clk_id, long long deadline,
+                                  struct timespec *rem)
+{
+  struct timespec now, timeout;
+  long long spin = ts_config.precision.enabled ?
+                     ts_config.precision.spin * 1000000000L : 0;
+  int saved_errno = errno;
+  timescaler_timerslack();
+
+  for(;;)
+  {
+    unsigned sequence = __atomic_load_n(&ts_config.anchor.sequence,
+                                        __ATOMIC_ACQUIRE);
+    timescaler_scaled_time(clk_id, &now);
+    long long remaining = deadline - timespec2ns(&now);
+    if(remaining <= 0)
+      break;
+
+    /* Wait forever while paused, the resume will wake the thread up */
+    struct timespec *p_timeout = NULL;
+    if(!ts_config.anchor.paused)
+    {
+      long long wait = ceil(remaining * ts_config.scale);
+      if(wait <= spin)
+        continue;
+      ns2timespec(wait - spin, &timeout);
+      p_timeout = &timeout;
+    }
+
+    if(timescaler_futex((int *)&ts_config.anchor.sequence, FUTEX_WAIT_PRIVATE,
+                        sequence, p_timeout, NULL, 0) && errno == EINTR)
+    {
+      if(rem)
+      {
+        timescaler_scaled_time(clk_id, &now);
+        remaining = deadline - timespec2ns(&now);
+        ns2timespec(remaining > 0 ? remaining : 0, rem);
+      }
+      errno = saved_errno;
+      return EINTR;
+    }
+  }
+
+  errno = saved_errno;
+  return 0;
+}
+
+
+/**
+ * Re-anchor the scaled clocks at the current time and change the scale, the
+ * pause state and the offset atomically for the readers
+ * @param scale: the new scale or 0 to keep the current one
+ * @param paused: the new pause state or -1 to keep the current one
+ * @param advance: the time to add to the scaled clocks in nanoseconds
+ */
+static void timescaler_reanchor(double scale, int paused, long long advance)
+{
+  struct timespec tp;
+
+  pthread_mutex_lock(&ts_config.anchor.lock);
+  unsigned sequence = ts_config.anchor.sequence;
+  __atomic_store_n(&ts_config.anchor.sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+#define ANCHOR(clock, clk_id)                                                 \
+  REAL(clock_gettime)(clk_id, &tp);                                 \
+  if(!ts_config.anchor.paused)                                                \
+    ts_config.anchor.clock.scaled += (timespec2ns(&tp) - ts_config.anchor.clock.real) / ts_config.scale; \
+  ts_config.anchor.clock.scaled += advance;                                   \
+  ts_config.anchor.clock.real = timespec2ns(&tp)
+  ANCHOR(realtime, CLOCK_REALTIME);
+  ANCHOR(monotonic, CLOCK_MONOTONIC);
+#undef ANCHOR
+
+  if(scale > 0.0)
+    ts_config.scale = scale;
+  if(paused >= 0)
+    ts_config.anchor.paused = paused;
+
+  __atomic_store_n(&ts_config.anchor.sequence, sequence + 2, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&ts_config.anchor.lock);
+
+  /* Wake up the threads sleeping until a scaled deadline */
+  timescaler_futex((int *)&ts_config.anchor.sequence, FUTEX_WAKE_PRIVATE,
+                   INT_MAX, NULL, NULL, 0);
+}
+
+
+/**
+ * Find a variable in an environment
+ * @param envp: the environment
+ * @param count: the number of variables in the environment
+ * @param psz_var: the variable, as NAME or NAME=value
+ * @return the index of the variable or -1 if not found
+ */
+static int timescaler_env_find(char *const envp[], unsigned count,
+                              const char *psz_var)
+{
+  size_t len = strcspn(psz_var, "=");
+  unsigned i;
+
+  for(i = 0; i < count; i++)
+    if(!strncmp(envp[i], psz_var, len) && envp[i][len] == '=')
+      return i;
+  return -1;
+}
+
+
+/**
+ * Find the rule matching the program executed by a child
+ * @param psz_path: the path to the program
+ * @return the rule or NULL if none matches
+ */
+static const exec_rule *timescaler_rule(const char *psz_path)
+{
+  const char *psz_program = strrchr(psz_path, '/');
+  psz_program = psz_program ? psz_program + 1 : psz_path;
+
+  unsigned i;
+  for(i = 0; i < ts_config.children.rules_count; i++)
+    if(!strcmp(ts_config.children.rules[i].psz_program, psz_program))
+      return &ts_config.children.rules[i];
+  return NULL;
+}
+
+
+/**
+ * Compute the sizes needed by timescaler_environ
+ * @param psz_path: the path to the program executed by the child
+ * @param envp: the environment given by the parent
+ * @param preload_size: the size of the LD_PRELOAD variable
+ * @return the number of entries of the environment of the child
+ */
+static size_t timescaler_environ_size(const char *psz_path, char *const envp[],
+                                     size_t *preload_size)
+{
+  const exec_rule *rule = timescaler_rule(psz_path);
+  unsigned count = 0;
+
+  while(envp && envp[count])
+    count++;
+
+  *preload_size = 1;
+  if(ts_config.children.psz_preload)
+  {
+    int index = timescaler_env_find(envp, count, "LD_PRELOAD");
+    *preload_size += strlen("LD_PRELOAD= ") + strlen(ts_config.children.psz_preload) +
+                     (index < 0 ? 0 : strlen(envp[index]));
+  }
+
+  return count + CONFIG_VARS + (rule ? rule->count : 0) + 4;
+}
+
+
+/**
+ * Build the environment of a child: the configuration of timescaler and the
+ * library to preload are added when missing, the scale and the clocks are
+ * always the current ones of the parent and the variables of the rule
+ * matching the program override the ones given by the parent
+ * @param psz_path: the path to the program executed by the child
+ * @param envp: the environment given by the parent
+ * @param new_envp: the environment of the child, see timescaler_environ_size
+ * @param psz_preload: buffer for the LD_PRELOAD variable
+ * @param clocks: buffer for the state of the scaled clocks
+ */
+static void timescaler_environ(const char *psz_path, char *const envp[],
+                              char **new_envp, char *psz_preload,
+                              child_clocks *clocks)
+{
+  const exec_rule *rule = timescaler_rule(psz_path);
+  unsigned i, count = 0;
+
+  /* The scale and the clocks of the parent right now */
+  struct timespec realtime, monotonic, scaled_realtime, scaled_monotonic;
+  REAL(clock_gettime)(CLOCK_REALTIME, &realtime);
+  timescaler_scaled_time(CLOCK_REALTIME, &scaled_realtime);
+  REAL(clock_gettime)(CLOCK_MONOTONIC, &monotonic);
+  timescaler_scaled_time(CLOCK_MONOTONIC, &scaled_monotonic);
+
+  sprintf(clocks->psz_scale, "TIMESCALER_SCALE=%.17g", ts_config.scale);
+  sprintf(clocks->psz_anchor, "TIMESCALER_ANCHOR=%lld:%lld:%lld:%lld:%d",
+          timespec2ns(&realtime), timespec2ns(&scaled_realtime),
+          timespec2ns(&monotonic), timespec2ns(&scaled_monotonic),
+          ts_config.anchor.paused ? 1 : 0);
+
+  /* Keep the variables not overridden by the rule or by the current state */
+  for(i = 0; envp && envp[i]; i++)
+    if((!rule || timescaler_env_find(rule->ppsz_vars, rule->count, envp[i]) < 0) &&
+       strncmp(envp[i], "TIMESCALER_SCALE=", strlen("TIMESCALER_SCALE=")) &&
+       strncmp(envp[i], "TIMESCALER_ANCHOR=", strlen("TIMESCALER_ANCHOR=")))
+      new_envp[count++] = envp[i];
+
+  if(!rule || timescaler_env_find(rule->ppsz_vars, rule->count, clocks->psz_scale) < 0)
+    new_envp[count++] = clocks->psz_scale;
+  if(!rule || timescaler_env_find(rule->ppsz_vars, rule->count, clocks->psz_anchor) < 0)
+    new_envp[count++] = clocks->psz_anchor;
+
+  /* Add the missing configuration */
+  for(i = 0; i < CONFIG_VARS; i++)
+    if(ts_config.children.ppsz_vars[i] &&
+       timescaler_env_find(new_envp, count, ts_config.children.ppsz_vars[i]) < 0 &&
+       (!rule || timescaler_env_find(rule->ppsz_vars, rule->count, ts_config.children.ppsz_vars[i]) < 0))
+      new_envp[count++] = ts_config.children.ppsz_vars[i];
+
+  if(rule)
+  {
+    timescaler_log(DEBUG, "Applying the rule for '%s'", rule->psz_program);
+    for(i = 0; i < rule->count; i++)
+      new_envp[count++] = rule->ppsz_vars[i];
+  }
+
+  /* Preload the library unless the rule decides otherwise */
+  if(ts_config.children.psz_preload &&
+     (!rule || timescaler_env_find(rule->ppsz_vars, rule->count, "LD_PRELOAD") < 0))
+  {
+    int index = timescaler_env_find(new_envp, count, "LD_PRELOAD");
+    if(index < 0)
+    {
+      sprintf(psz_preload, "LD_PRELOAD=%s", ts_config.children.psz_preload);
+      new_envp[count++] = psz_preload;
+    }
+    else if(!strstr(new_envp[index], ts_config.children.psz_preload))
+    {
+      sprintf(psz_preload, "LD_PRELOAD=%s %s", ts_config.children.psz_preload,
+              new_envp[index] + strlen("LD_PRELOAD="));
+      new_envp[index] = psz_preload;
+    }
+  }
+
+  new_envp[count] = NULL;
+}
+
+
 /**
  * The alarm function
  */
-GLOBAL unsigned int alarm(unsigned int seconds)
+GLOBAL unsigned int HOOKED(alarm)(unsigned int seconds)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(alarm)))
-    return ts_config.funcs.alarm(seconds);
-
-  return ts_config.funcs.alarm(seconds * ts_config.scale) / ts_config.scale;
+    return REAL(alarm)(seconds);
+
+  /* The scaled time is not a whole number of seconds in general, so the
+     timer is set with setitimer like the original function does */
+  struct itimerval new_value, old_value;
+  struct timeval value = { .tv_sec = seconds, .tv_usec = 0 };
+  memset(&new_value, 0, sizeof(new_value));
+  timescaler_scale_timeval(&value, &new_value.it_value);
+
+  if(REAL(setitimer)(ITIMER_REAL, &new_value, &old_value) < 0)
+    return 0;
+
+  /* Round the remaining time like the original function */
+  double2timeval(timeval2double(&old_value.it_value) / ts_config.scale,
+                 &old_value.it_value);
+  unsigned int remaining = old_value.it_value.tv_sec;
+  if(old_value.it_value.tv_usec >= 500000 ||
+     (!remaining && old_value.it_value.tv_usec > 0))
+    remaining++;
+  return remaining;
 }
 
 
@@ -360,12 +1123,12 @@ GLOBAL unsigned int alarm(unsigned int seconds)
  * The clock_gettime function
  * TODO: more clk_id should be used
  */
-GLOBAL int clock_gettime(clockid_t clk_id, struct timespec *tp)
+GLOBAL int HOOKED(clock_gettime)(clockid_t clk_id, struct timespec *tp)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(clock_gettime)))
-    return ts_config.funcs.clock_gettime(clk_id, tp);
+    return REAL(clock_gettime)(clk_id, tp);
 
   if(clk_id != CLOCK_REALTIME && clk_id != CLOCK_MONOTONIC)
   {
@@ -373,34 +1136,21 @@ GLOBAL int clock_gettime(clockid_t clk_id, struct timespec *tp)
     return EINVAL;
   }
 
-  int return_value = ts_config.funcs.clock_gettime(clk_id, tp);
-
-
-  double time;
-  double now = timespec2double(tp);
-
-  if(clk_id == CLOCK_REALTIME)
-    time = ts_config.initial.clock_realtime + (now - ts_config.initial.clock_realtime) / ts_config.scale;
-  else
-    time = ts_config.initial.clock_monotonic + (now - ts_config.initial.clock_monotonic) / ts_config.scale;
-
-  double2timespec(time, tp);
-
-  return return_value;
+  return timescaler_scaled_time(clk_id, tp);
 }
 
 
 /**
  * The clock_nanosleep function
  */
-GLOBAL int clock_nanosleep(clockid_t clk_id, int flags,
-                           const struct timespec *req,
-                           struct timespec *remain)
+GLOBAL int HOOKED(clock_nanosleep)(clockid_t clk_id, int flags,
+                                   const struct timespec *req,
+                                   struct timespec *remain)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(clock_nanosleep)))
-    return ts_config.funcs.clock_nanosleep(clk_id, flags, req, remain);
+    return REAL(clock_nanosleep)(clk_id, flags, req, remain);
 
   if(clk_id != CLOCK_REALTIME && clk_id != CLOCK_MONOTONIC)
   {
@@ -408,97 +1158,228 @@ GLOBAL int clock_nanosleep(clockid_t clk_id, int flags,
     return EINVAL;
   }
 
-  /* Transform the time to a double */
-  double time = timespec2double(req);
+  /* An absolute deadline is expressed in the time seen by the program */
+  struct timespec now;
+  long long deadline = timespec2ns(req);
+  timescaler_scaled_time(clk_id, &now);
 
-  /* Transform an absolute wait into a relative one */
   if(flags == TIMER_ABSTIME)
   {
-    struct timespec req_now;
-    ts_config.funcs.clock_gettime(clk_id, &req_now);
+    if(!IS_HOOKED(clock_gettime))
+    {
+      struct timespec real_now;
+      REAL(clock_gettime)(clk_id, &real_now);
+      deadline += timespec2ns(&now) - timespec2ns(&real_now);
+    }
 
-    time -= timespec2double(&req_now);
-    if(time <= 0.0)
-      return 0;
+    /* The remaining time is only meaningful for relative waits */
+    remain = NULL;
   }
+  else
+    deadline += timespec2ns(&now);
 
-  /* TODO: check the return value for remaining time to sleep */
-  struct timespec req_scale;
-  double2timespec(time, &req_scale);
-
-  int return_value = ts_config.funcs.clock_nanosleep(clk_id, 0, &req_scale, remain);
-  return return_value;
+  return timescaler_sleep_until(clk_id, deadline, remain);
 }
 
 
 /**
  * The epoll_pwait function
  */
-GLOBAL int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
-                       int timeout, const sigset_t *sigmask)
+GLOBAL int HOOKED(epoll_pwait)(int epfd, struct epoll_event *events,
+                               int maxevents, int timeout,
+                               const sigset_t *sigmask)
 {
   PROLOGUE();
 
   /* No need to scale if if the timeout is 0 (return immediately) or -1
      (infinite) */
   if(unlikely(!IS_HOOKED(epoll_pwait) || timeout <= 0))
-    return ts_config.funcs.epoll_pwait(epfd, events, maxevents, timeout,
-                                       sigmask);
+    return REAL(epoll_pwait)(epfd, events, maxevents, timeout,
+                             sigmask);
 
-  return ts_config.funcs.epoll_pwait(epfd, events, maxevents,
-                                     timeout * ts_config.scale, sigmask);
+  /* Round up so that a short timeout does not become a busy loop */
+  timescaler_timerslack();
+  return REAL(epoll_pwait)(epfd, events, maxevents,
+                           ceil(timeout * ts_config.scale), sigmask);
 }
 
 
 /**
  * The epoll_wait function
  */
-GLOBAL int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
-                      int timeout)
+GLOBAL int HOOKED(epoll_wait)(int epfd, struct epoll_event *events,
+                              int maxevents, int timeout)
 {
   PROLOGUE();
 
   /* No need to scale if if the timeout is 0 (return immediately) or -1
      (infinite) */
   if(unlikely(!IS_HOOKED(epoll_wait) || timeout <= 0))
-    return ts_config.funcs.epoll_wait(epfd, events, maxevents, timeout);
+    return REAL(epoll_wait)(epfd, events, maxevents, timeout);
+
+  /* Round up so that a short timeout does not become a busy loop */
+  timescaler_timerslack();
+  return REAL(epoll_wait)(epfd, events, maxevents,
+                          ceil(timeout * ts_config.scale));
+}
+
+
+/**
+ * The execl function
+ */
+GLOBAL int HOOKED(execl)(const char *path, const char *arg, ...)
+{
+  PROLOGUE();
+
+  va_list args;
+  EXECL_ARGV(argv, arg, args);
+  va_end(args);
+
+  if(unlikely(!IS_HOOKED(execl)))
+    return REAL(execv)(path, argv);
+
+  CHILD_ENVIRON(new_envp, path, environ);
+  return REAL(execve)(path, argv, new_envp);
+}
+
+
+/**
+ * The execle function
+ */
+GLOBAL int HOOKED(execle)(const char *path, const char *arg, ...)
+{
+  PROLOGUE();
+
+  va_list args;
+  EXECL_ARGV(argv, arg, args);
+  char *const *envp = va_arg(args, char *const *);
+  va_end(args);
+
+  if(unlikely(!IS_HOOKED(execle)))
+    return REAL(execve)(path, argv, envp);
+
+  CHILD_ENVIRON(new_envp, path, envp);
+  return REAL(execve)(path, argv, new_envp);
+}
+
+
+/**
+ * The execlp function
+ */
+GLOBAL int HOOKED(execlp)(const char *file, const char *arg, ...)
+{
+  PROLOGUE();
+
+  va_list args;
+  EXECL_ARGV(argv, arg, args);
+  va_end(args);
+
+  if(unlikely(!IS_HOOKED(execlp)))
+    return REAL(execvp)(file, argv);
+
+  CHILD_ENVIRON(new_envp, file, environ);
+  return REAL(execvpe)(file, argv, new_envp);
+}
+
+
+/**
+ * The execv function
+ */
+GLOBAL int HOOKED(execv)(const char *path, char *const argv[])
+{
+  PROLOGUE();
+
+  if(unlikely(!IS_HOOKED(execv)))
+    return REAL(execv)(path, argv);
+
+  CHILD_ENVIRON(new_envp, path, environ);
+  return REAL(execve)(path, argv, new_envp);
+}
+
+
+/**
+ * The execve function
+ */
+GLOBAL int HOOKED(execve)(const char *path, char *const argv[],
+                          char *const envp[])
+{
+  PROLOGUE();
+
+  if(unlikely(!IS_HOOKED(execve)))
+    return REAL(execve)(path, argv, envp);
 
-  return ts_config.funcs.epoll_wait(epfd, events, maxevents,
-                                    timeout * ts_config.scale);
+  CHILD_ENVIRON(new_envp, path, envp);
+  return REAL(execve)(path, argv, new_envp);
+}
+
+
+/**
+ * The execvp function
+ */
+GLOBAL int HOOKED(execvp)(const char *file, char *const argv[])
+{
+  PROLOGUE();
+
+  if(unlikely(!IS_HOOKED(execvp)))
+    return REAL(execvp)(file, argv);
+
+  CHILD_ENVIRON(new_envp, file, environ);
+  return REAL(execvpe)(file, argv, new_envp);
+}
+
+
+/**
+ * The execvpe function
+ */
+GLOBAL int HOOKED(execvpe)(const char *file, char *const argv[],
+                           char *const envp[])
+{
+  PROLOGUE();
+
+  if(unlikely(!IS_HOOKED(execvpe)))
+    return REAL(execvpe)(file, argv, envp);
+
+  CHILD_ENVIRON(new_envp, file, envp);
+  return REAL(execvpe)(file, argv, new_envp);
 }
 
 
 /**
  * The futex function
  */
-GLOBAL int futex(int *uaddr, int op, int val, const struct timespec *timeout,
-                 int *uaddr2, int val3)
+GLOBAL int HOOKED(futex)(int *uaddr, int op, int val,
+                         const struct timespec *timeout, int *uaddr2, int val3)
 {
   PROLOGUE();
 
   /* We only have to support the FUTEX_WAIT operation */
   /* The other ones ignore the timeout argument */
   if(unlikely(!IS_HOOKED(futex)) || op != FUTEX_WAIT)
-    return ts_config.funcs.futex(uaddr, op, val, timeout, uaddr2, val3);
+    return REAL(futex)(uaddr, op, val, timeout, uaddr2, val3);
+
+  /* A NULL timeout means waiting forever */
+  if(!timeout)
+    return REAL(futex)(uaddr, op, val, NULL, uaddr2, val3);
 
+  timescaler_timerslack();
   struct timespec timeout_scale;
   double time = timespec2double(timeout) * ts_config.scale;
   double2timespec(time, &timeout_scale);
 
-  return ts_config.funcs.futex(uaddr, op, val, &timeout_scale, uaddr2, val3);
+  return REAL(futex)(uaddr, op, val, &timeout_scale, uaddr2, val3);
 }
 
 /**
  * The getitimer function
  */
-GLOBAL int getitimer(int which, struct itimerval *curr_value)
+GLOBAL int HOOKED(getitimer)(int which, struct itimerval *curr_value)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(getitimer)))
-    return ts_config.funcs.getitimer(which, curr_value);
+    return REAL(getitimer)(which, curr_value);
 
-  int return_value = ts_config.funcs.getitimer(which, curr_value);
+  int return_value = REAL(getitimer)(which, curr_value);
   double value = timeval2double(&curr_value->it_value) / ts_config.scale;
   double interval = timeval2double(&curr_value->it_interval) / ts_config.scale;
 
@@ -512,18 +1393,21 @@ GLOBAL int getitimer(int which, struct itimerval *curr_value)
 /**
  * The gettimeofday function
  */
-GLOBAL int gettimeofday(struct timeval *tv, struct timezone *tz)
+GLOBAL int HOOKED(gettimeofday)(struct timeval *tv, timezone_ptr_t tz)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(gettimeofday)))
-    return ts_config.funcs.gettimeofday(tv, tz);
+    return REAL(gettimeofday)(tv, tz);
 
-  int return_value = ts_config.funcs.gettimeofday(tv, tz);
-  double now = timeval2double(tv);
-  double time = ts_config.initial.time + (now - ts_config.initial.time) / ts_config.scale;
+  int return_value = REAL(gettimeofday)(tv, tz);
+  if(return_value)
+    return return_value;
 
-  double2timeval(time, tv);
+  struct timespec tp;
+  timescaler_scaled_time(CLOCK_REALTIME, &tp);
+  tv->tv_sec = tp.tv_sec;
+  tv->tv_usec = tp.tv_nsec / 1000;
 
   return return_value;
 }
@@ -532,98 +1416,146 @@ GLOBAL int gettimeofday(struct timeval *tv, struct timezone *tz)
 /**
  * The nanosleep function
  */
-GLOBAL int nanosleep(const struct timespec *req, struct timespec *rem)
+GLOBAL int HOOKED(nanosleep)(const struct timespec *req, struct timespec *rem)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(nanosleep)))
-    return ts_config.funcs.nanosleep(req, rem);
+    return REAL(nanosleep)(req, rem);
 
-  struct timespec req_scale;
-  double time = timespec2double(req) * ts_config.scale;
-  double2timespec(time, &req_scale);
+  /* Let the original function report invalid arguments */
+  if(req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L)
+    return REAL(nanosleep)(req, rem);
 
-  int return_value = ts_config.funcs.nanosleep(&req_scale, rem);
+  struct timespec now;
+  timescaler_scaled_time(CLOCK_MONOTONIC, &now);
 
-  if(return_value != 0 && rem)
+  int return_value = timescaler_sleep_until(CLOCK_MONOTONIC,
+                                            timespec2ns(&now) + timespec2ns(req),
+                                            rem);
+  if(return_value)
   {
-    double rem_time = timespec2double(rem) / ts_config.scale;
-    double2timespec(rem_time, rem);
+    errno = return_value;
+    return -1;
   }
-
-  return return_value;
+  return 0;
 }
 
 
 /**
  * The poll function
  */
-GLOBAL int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+GLOBAL int HOOKED(poll)(struct pollfd *fds, nfds_t nfds, int timeout)
 {
   PROLOGUE();
   if(unlikely(!IS_HOOKED(poll)))
-    return ts_config.funcs.poll(fds, nfds, timeout);
+    return REAL(poll)(fds, nfds, timeout);
 
   /* If the timeout is negative, no need to scale it */
-  return ts_config.funcs.poll(fds, nfds, timeout < 0 ?
-                                         timeout :
-                                         timeout * ts_config.scale);
+  if(timeout <= 0)
+    return REAL(poll)(fds, nfds, timeout);
+
+  /* The scaled timeout is not a whole number of milliseconds in general */
+  timescaler_timerslack();
+  struct timespec timeout_scale;
+  double2timespec(timeout * ts_config.scale / 1000, &timeout_scale);
+
+  /* ppoll is only declared with _GNU_SOURCE: call the system call */
+  return syscall(SYS_ppoll, fds, nfds, &timeout_scale, NULL, 0);
+}
+
+
+/**
+ * The posix_spawn function
+ */
+GLOBAL int HOOKED(posix_spawn)(pid_t *pid, const char *path,
+                               const posix_spawn_file_actions_t *file_actions,
+                               const posix_spawnattr_t *attrp,
+                               char *const argv[], char *const envp[])
+{
+  PROLOGUE();
+
+  if(unlikely(!IS_HOOKED(posix_spawn)))
+    return REAL(posix_spawn)(pid, path, file_actions, attrp, argv, envp);
+
+  CHILD_ENVIRON(new_envp, path, envp);
+  return REAL(posix_spawn)(pid, path, file_actions, attrp, argv, new_envp);
+}
+
+
+/**
+ * The posix_spawnp function
+ */
+GLOBAL int HOOKED(posix_spawnp)(pid_t *pid, const char *file,
+                                const posix_spawn_file_actions_t *file_actions,
+                                const posix_spawnattr_t *attrp,
+                                char *const argv[], char *const envp[])
+{
+  PROLOGUE();
+
+  if(unlikely(!IS_HOOKED(posix_spawnp)))
+    return REAL(posix_spawnp)(pid, file, file_actions, attrp, argv, envp);
+
+  CHILD_ENVIRON(new_envp, file, envp);
+  return REAL(posix_spawnp)(pid, file, file_actions, attrp, argv, new_envp);
 }
 
 
 /**
  * The pselect function
  */
-int pselect(int nfds, fd_set *readfds, fd_set *writefds,
-            fd_set *exceptfds, const struct timespec *timeout,
-            const sigset_t *sigmask)
+int HOOKED(pselect)(int nfds, fd_set *readfds, fd_set *writefds,
+                    fd_set *exceptfds, const struct timespec *timeout,
+                    const sigset_t *sigmask)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(pselect)))
-    return ts_config.funcs.pselect(nfds, readfds, writefds, exceptfds, timeout,
-                                   sigmask);
+    return REAL(pselect)(nfds, readfds, writefds, exceptfds, timeout,
+                         sigmask);
 
   /* The timeout can be NULL, which mean that pselect will wait forever */
   if(timeout)
   {
     /* Scale the timeout */
+    timescaler_timerslack();
     double time = timespec2double(timeout) * ts_config.scale;
     struct timespec timeout_scale;
     double2timespec(time, &timeout_scale);
 
-    return ts_config.funcs.pselect(nfds, readfds, writefds, exceptfds,
-                                   &timeout_scale, sigmask);
+    return REAL(pselect)(nfds, readfds, writefds, exceptfds,
+                         &timeout_scale, sigmask);
   }
   else
-    return ts_config.funcs.pselect(nfds, readfds, writefds, exceptfds, NULL,
-                                   sigmask);
+    return REAL(pselect)(nfds, readfds, writefds, exceptfds, NULL,
+                         sigmask);
 }
 
 
 /**
  * The select function
  */
-int select(int nfds, fd_set *readfds, fd_set *writefds,
-           fd_set *exceptfds, struct timeval *timeout)
+int HOOKED(select)(int nfds, fd_set *readfds, fd_set *writefds,
+                   fd_set *exceptfds, struct timeval *timeout)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(select)))
-    return ts_config.funcs.select(nfds, readfds, writefds, exceptfds, timeout);
+    return REAL(select)(nfds, readfds, writefds, exceptfds, timeout);
 
   /* The timeout can be NULL, which mean that pselect will wait forever */
   if(timeout)
   {
     int return_value;
     /* Scale the timeout */
+    timescaler_timerslack();
     double time = timeval2double(timeout) * ts_config.scale;
     struct timeval timeout_scale;
     double2timeval(time, &timeout_scale);
 
     /* Call the real function */
-    return_value = ts_config.funcs.select(nfds, readfds, writefds, exceptfds,
-                                          &timeout_scale);
+    return_value = REAL(select)(nfds, readfds, writefds, exceptfds,
+                                &timeout_scale);
 
     /* Un-scale the returned timeout (remaining time) */
     time = timeval2double(&timeout_scale) / ts_config.scale;
@@ -632,35 +1564,33 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
     return return_value;
   }
   else
-    return ts_config.funcs.select(nfds, readfds, writefds, exceptfds, NULL);
+    return REAL(select)(nfds, readfds, writefds, exceptfds, NULL);
 }
 
 
 /**
  * The setitimer function
  */
-GLOBAL int setitimer(int which, const struct itimerval *new_value,
-                     struct itimerval *old_value)
+GLOBAL int HOOKED(setitimer)(int which, const struct itimerval *new_value,
+                             struct itimerval *old_value)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(setitimer)))
-    return ts_config.funcs.setitimer(which, new_value, old_value);
+    return REAL(setitimer)(which, new_value, old_value);
 
   struct itimerval new_value_scale;
-  double value = timeval2double(&new_value->it_value) * ts_config.scale;
-  double interval = timeval2double(&new_value->it_interval) * ts_config.scale;
-  double2timeval(value, &(new_value_scale.it_value));
-  double2timeval(interval, &(new_value_scale.it_interval));
+  timescaler_scale_timeval(&new_value->it_value, &new_value_scale.it_value);
+  timescaler_scale_timeval(&new_value->it_interval, &new_value_scale.it_interval);
 
-  int return_value = ts_config.funcs.setitimer(which, &new_value_scale,
-                                               old_value);
+  int return_value = REAL(setitimer)(which, &new_value_scale,
+                                     old_value);
 
   // Change the old_value if not NULL
   if(old_value)
   {
-    value = timeval2double(&old_value->it_value) / ts_config.scale;
-    interval = timeval2double(&old_value->it_interval) / ts_config.scale;
+    double value = timeval2double(&old_value->it_value) / ts_config.scale;
+    double interval = timeval2double(&old_value->it_interval) / ts_config.scale;
 
     double2timeval(value, &(old_value->it_value));
     double2timeval(interval, &(old_value->it_interval));
@@ -673,30 +1603,117 @@ GLOBAL int setitimer(int which, const struct itimerval *new_value,
 /**
  * The sleep function
  */
-GLOBAL unsigned int sleep(unsigned int seconds)
+GLOBAL unsigned int HOOKED(sleep)(unsigned int seconds)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(sleep)))
-    return ts_config.funcs.sleep(seconds);
+    return REAL(sleep)(seconds);
+
+  struct timespec now, rem;
+  timescaler_scaled_time(CLOCK_MONOTONIC, &now);
+
+  if(!timescaler_sleep_until(CLOCK_MONOTONIC,
+                             timespec2ns(&now) + seconds * 1000000000LL, &rem))
+    return 0;
+
+  /* Round the remaining time like the original function */
+  return rem.tv_sec + (rem.tv_nsec >= 500000000L);
+}
+
 
-  unsigned int return_value = ts_config.funcs.sleep(seconds * ts_config.scale);
-  return return_value / ts_config.scale;
+/**
+ * The system function: the libc does not call the exec functions through the
+ * PLT, so the shell is spawned here with the same signal handling
+ */
+GLOBAL int HOOKED(system)(const char *command)
+{
+  PROLOGUE();
+
+  /* A NULL command only checks that a shell is available */
+  if(unlikely(!IS_HOOKED(system)) || !command)
+    return REAL(system)(command);
+
+  /* Ignore SIGINT and SIGQUIT while some threads are waiting for a shell:
+     the first one saves the handlers and the last one restores them */
+  struct sigaction ignore;
+  memset(&ignore, 0, sizeof(ignore));
+  ignore.sa_handler = SIG_IGN;
+  sigemptyset(&ignore.sa_mask);
+
+  pthread_mutex_lock(&ts_config.shell.lock);
+  if(ts_config.shell.count++ == 0)
+  {
+    sigaction(SIGINT, &ignore, &ts_config.shell.intr);
+    sigaction(SIGQUIT, &ignore, &ts_config.shell.quit);
+  }
+  int intr_ignored = ts_config.shell.intr.sa_handler == SIG_IGN;
+  int quit_ignored = ts_config.shell.quit.sa_handler == SIG_IGN;
+  pthread_mutex_unlock(&ts_config.shell.lock);
+
+  /* Block SIGCHLD while waiting for the shell */
+  sigset_t block, omask;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &omask);
+
+  /* The shell gets the original signal mask and handlers back */
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  if(!intr_ignored)
+    sigaddset(&defaults, SIGINT);
+  if(!quit_ignored)
+    sigaddset(&defaults, SIGQUIT);
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, &omask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+  char *argv[] = { "sh", "-c", (char *)command, NULL };
+  CHILD_ENVIRON(new_envp, "/bin/sh", environ);
+
+  pid_t pid;
+  int status;
+  if(REAL(posix_spawn)(&pid, "/bin/sh", NULL, &attr, argv, new_envp))
+    status = 127 << 8;
+  else
+  {
+    while(waitpid(pid, &status, 0) < 0)
+      if(errno != EINTR)
+      {
+        status = -1;
+        break;
+      }
+  }
+  posix_spawnattr_destroy(&attr);
+
+  pthread_mutex_lock(&ts_config.shell.lock);
+  if(--ts_config.shell.count == 0)
+  {
+    sigaction(SIGINT, &ts_config.shell.intr, NULL);
+    sigaction(SIGQUIT, &ts_config.shell.quit, NULL);
+  }
+  pthread_mutex_unlock(&ts_config.shell.lock);
+  sigprocmask(SIG_SETMASK, &omask, NULL);
+  return status;
 }
 
 
 /**
  * The time function
  */
-GLOBAL time_t time(time_t* tp)
+GLOBAL time_t HOOKED(time)(time_t* tp)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(time)))
-    return ts_config.funcs.time(tp);
+    return REAL(time)(tp);
 
-  time_t now = ts_config.funcs.time(NULL);
-  time_t return_value = ts_config.initial.time + (double)(now - ts_config.initial.time) / ts_config.scale;
+  struct timespec now;
+  timescaler_scaled_time(CLOCK_REALTIME, &now);
+  time_t return_value = now.tv_sec;
 
   if(tp)
     *tp = return_value;
@@ -708,14 +1725,14 @@ GLOBAL time_t time(time_t* tp)
  * The times function
  */
 
-clock_t times(struct tms *buf)
+clock_t HOOKED(times)(struct tms *buf)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(times)))
-    return ts_config.funcs.times(buf);
+    return REAL(times)(buf);
 
-  clock_t return_value = ts_config.funcs.times(buf);
+  clock_t return_value = REAL(times)(buf);
   buf->tms_utime = buf->tms_utime / ts_config.scale;
   buf->tms_stime = buf->tms_stime / ts_config.scale;
   buf->tms_cutime = buf->tms_cutime / ts_config.scale;
@@ -723,35 +1740,139 @@ clock_t times(struct tms *buf)
 
   if(return_value == (clock_t)-1)
     return return_value;
-  else
-    return ts_config.initial.times + (return_value - ts_config.initial.times) / ts_config.scale;
+
+  /* The elapsed ticks follow the scaled monotonic clock */
+  struct timespec now;
+  timescaler_scaled_time(CLOCK_MONOTONIC, &now);
+  return ts_config.initial.times + (timespec2ns(&now) - ts_config.initial.monotonic) *
+                                   ts_config.initial.clock_ticks / 1000000000LL;
 }
 
 
 /**
  * The ualarm function
  */
-useconds_t ualarm(useconds_t usecs, useconds_t interval)
+useconds_t HOOKED(ualarm)(useconds_t usecs, useconds_t interval)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(ualarm)))
-    return ts_config.funcs.ualarm(usecs, interval);
+    return REAL(ualarm)(usecs, interval);
+
+  /* A non-zero time stays non-zero as a zero time would disarm the timer */
+  useconds_t usecs_scale = usecs * ts_config.scale;
+  useconds_t interval_scale = interval * ts_config.scale;
+  if(usecs && !usecs_scale)
+    usecs_scale = 1;
+  if(interval && !interval_scale)
+    interval_scale = 1;
 
-  return ts_config.funcs.ualarm(usecs * ts_config.scale,
-                                interval * ts_config.scale) / ts_config.scale;
+  return REAL(ualarm)(usecs_scale, interval_scale) / ts_config.scale;
 }
 
 
 /**
  * The usleep function
  */
-int usleep(useconds_t usec)
+int HOOKED(usleep)(useconds_t usec)
 {
   PROLOGUE();
 
   if(unlikely(!IS_HOOKED(usleep)))
-    return ts_config.funcs.usleep(usec);
+    return REAL(usleep)(usec);
+
+  struct timespec now;
+  timescaler_scaled_time(CLOCK_MONOTONIC, &now);
+
+  int return_value = timescaler_sleep_until(CLOCK_MONOTONIC,
+                                            timespec2ns(&now) + usec * 1000LL,
+                                            NULL);
+  if(return_value)
+  {
+    errno = return_value;
+    return -1;
+  }
+  return 0;
+}
+
+
 
-  return ts_config.funcs.usleep(usec * ts_config.scale);
+/**
+ * The timescaler_set_scale function
+ */
+GLOBAL int timescaler_set_scale(double scale)
+{
+  PROLOGUE();
+
+  if(scale <= 0.0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  timescaler_reanchor(scale, -1, 0);
+  return 0;
+}
+
+
+/**
+ * The timescaler_get_scale function
+ */
+GLOBAL double timescaler_get_scale(void)
+{
+  PROLOGUE();
+
+  return ts_config.scale;
+}
+
+
+/**
+ * The timescaler_pause function
+ */
+GLOBAL void timescaler_pause(void)
+{
+  PROLOGUE();
+
+  timescaler_reanchor(0.0, 1, 0);
+}
+
+
+/**
+ * The timescaler_resume function
+ */
+GLOBAL void timescaler_resume(void)
+{
+  PROLOGUE();
+
+  timescaler_reanchor(0.0, 0, 0);
 }
+
+
+/**
+ * The timescaler_advance function
+ */
+GLOBAL int timescaler_advance(int64_t ns)
+{
+  PROLOGUE();
+
+  /* Moving backward would break the monotonic clock */
+  if(ns < 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  timescaler_reanchor(0.0, -1, ns);
+  return 0;
+}
+
+
+/**
+ * The timescaler_now_real function
+ */
+GLOBAL int timescaler_now_real(clockid_t clk_id, struct timespec *tp)
+{
+  PROLOGUE();
+
+  return REAL(clock_gettime)(clk_id, tp);
+}
\ No newline at end of file
@@ -0,0 +1,115 @@
+/*****************************************************************************
+ * Copyright (C) 2012 Rémi Duraffort
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef TIMESCALER_H
+#define TIMESCALER_H
+
+#include <stdint.h>         /* int64_t */
+#include <sys/types.h>      /* clockid_t */
+#include <time.h>           /* struct timespec */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Only defined with the POSIX feature macros, e.g. not with -std=c99 */
+struct timespec;
+
+
+/**
+ * The functions are declared weak so that a program can be built without
+ * timescaler and check at runtime that the library is loaded, with
+ * timescaler_is_loaded(), before calling them.
+ * The weak references are only resolved at runtime in position independent
+ * programs (-fpie -pie, the default of most distributions): in a non-PIE
+ * program they are resolved to 0 by the linker and timescaler_is_loaded()
+ * always returns 0. Such a program should define TIMESCALER_NO_WEAK and link
+ * with timescaler.so or libtimescaler.a.
+ * Define TIMESCALER_NO_WEAK to get strong references.
+ */
+#if defined(__GNUC__) && !defined(TIMESCALER_NO_WEAK)
+# define TIMESCALER_WEAK __attribute__ ((weak))
+#else
+# define TIMESCALER_WEAK
+#endif
+
+
+/**
+ * Change the scale applied to the time. The scaled clocks are re-anchored so
+ * that they stay continuous.
+ * @param scale: the new scale, strictly positive
+ * @return 0 in case of success, -1 otherwise with errno set
+ */
+int timescaler_set_scale(double scale) TIMESCALER_WEAK;
+
+/**
+ * Get the scale currently applied to the time
+ * @return the scale
+ */
+double timescaler_get_scale(void) TIMESCALER_WEAK;
+
+/**
+ * Freeze the scaled clocks: clock_gettime, gettimeofday, time and times will
+ * return the same time until timescaler_resume is called. The threads sleeping
+ * in clock_nanosleep, nanosleep, sleep and usleep wait for the scaled clocks
+ * and are suspended meanwhile. The timeouts of the other functions (epoll,
+ * futex, poll, select and the timers) are not affected.
+ */
+void timescaler_pause(void) TIMESCALER_WEAK;
+
+/**
+ * Restart the scaled clocks from the time where they were paused
+ */
+void timescaler_resume(void) TIMESCALER_WEAK;
+
+/**
+ * Move the scaled clocks forward, paused or not. The threads sleeping in
+ * clock_nanosleep, nanosleep, sleep and usleep wake up if their deadline is
+ * reached.
+ * @param ns: the number of nanoseconds to add, positive
+ * @return 0 in case of success, -1 otherwise with errno set
+ */
+int timescaler_advance(int64_t ns) TIMESCALER_WEAK;
+
+/**
+ * Get the real (unscaled) time of the given clock
+ * @param clk_id: the clock to read
+ * @param tp: the real time
+ * @return 0 in case of success, -1 otherwise with errno set
+ */
+int timescaler_now_real(clockid_t clk_id, struct timespec *tp) TIMESCALER_WEAK;
+
+
+/**
+ * Check that timescaler is loaded in the current process
+ * @return 1 if the functions above can be called, 0 otherwise
+ */
+static inline int timescaler_is_loaded(void)
+{
+#if defined(__GNUC__) && !defined(TIMESCALER_NO_WEAK)
+  return timescaler_set_scale != 0;
+#else
+  return 1;
+#endif
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif